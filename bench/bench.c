@@ -0,0 +1,301 @@
+/*******************************************************************************
+ * bench.c
+ *
+ * Runs whole picsnvideos syncs against the mock VFS backend over synthetic
+ * albums, and reports wall time, DLP calls, bytes and local syscalls.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ******************************************************************************/
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libplugin.h"
+#include "engine.h"
+#include "mockdlp.h"
+
+static const char USAGE[] =
+"Usage: picsnvideos-bench [options]\n\
+  -f files      files per sync, default: runs 10, 100, 1000 and 10000\n\
+  -a albums     albums to spread the files over, default: files / 100 + 1\n\
+  -s size       average file size in bytes, default: 20000\n\
+  -l latency    usec per DLP call, default: 0\n\
+  -b bandwidth  bytes/s of the link, default: unlimited\n\
+  -q quirks     iterator quirks of the mock, 1: stop on full batch, 2: bogus iterator\n\
+  -r resyncs    syncs after the first one, default: 1\n\
+  -d devices    devices synced at once by separate threads, each with the files, default: 1\n\
+  -c            devices have files of the same names, but other sizes and contents, with skipKnownFiles\n\
+  -k            keep the temporary directory\n\
+  -v            show the plugin's debug output\n";
+
+/*
+ * Local syscalls of the engine are counted by wrapping the libc calls it uses (see Makefile.am), but open(2),
+ * as the mock uses it too, and read(2) and write(2) by /proc/self/io minus the reads of the mock.
+ */
+static unsigned long syscalls;
+
+#define WRAP(ret, name, params, args) \
+    ret __real_##name params; \
+    ret __wrap_##name params { __sync_fetch_and_add(&syscalls, 1); return __real_##name args; }
+
+WRAP(int, stat, (const char *path, struct stat *buf), (path, buf))
+WRAP(int, mkdir, (const char *path, mode_t mode), (path, mode))
+WRAP(int, futimens, (int fd, const struct timespec times[2]), (fd, times))
+WRAP(int, fsync, (int fd), (fd))
+WRAP(int, rename, (const char *oldpath, const char *newpath), (oldpath, newpath))
+WRAP(int, unlink, (const char *path), (path))
+WRAP(int, link, (const char *oldpath, const char *newpath), (oldpath, newpath))
+WRAP(DIR *, opendir, (const char *path), (path))
+WRAP(int, ftruncate, (int fd, off_t length), (fd, length))
+WRAP(FILE *, fopen, (const char *path, const char *mode), (path, mode))
+WRAP(int, fclose, (FILE *stream), (stream))
+WRAP(void *, mmap, (void *addr, size_t length, int prot, int flags, int fd, off_t offset), (addr, length, prot, flags, fd, offset))
+WRAP(int, munmap, (void *addr, size_t length), (addr, length))
+WRAP(int, madvise, (void *addr, size_t length, int advice), (addr, length, advice))
+WRAP(int, posix_fallocate, (int fd, off_t offset, off_t len), (fd, offset, len))
+
+static unsigned long ioSyscalls(void) {
+    char line[64];
+    unsigned long n, sum = 0;
+    FILE *io;
+    if (!(io = __real_fopen("/proc/self/io", "r")))  return 0;
+    while (fgets(line, sizeof(line), io)) {
+        if (sscanf(line, "syscr: %lu", &n) == 1 || sscanf(line, "syscw: %lu", &n) == 1)  sum += n;
+    }
+    __real_fclose(io);
+    return sum;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int writeFile(const char *path, size_t size, uint64_t seed) {
+    FILE *out;
+    uint64_t x = seed * 0x9E3779B97F4A7C15ull + 1;
+    if (!(out = __real_fopen(path, "w")))  return -1;
+    for (size_t i = 0; i < size; i += sizeof(x)) {
+        x ^= x << 13;  x ^= x >> 7;  x ^= x << 17; // xorshift64
+        fwrite(&x, 1, size - i < sizeof(x) ? size - i : sizeof(x), out);
+    }
+    return __real_fclose(out);
+}
+
+/*
+ * Create files in albums on the internal volume, every 20th being a video 10 times the size, and another
+ * an audio caption of a quarter.
+ * The files are numbered from first on, so several devices have distinct files, unless they
+ * start with the same number, and get other sizes and contents by different variants.
+ */
+static int createDevice(const char *root, int first, int files, int albums, size_t size, int variant) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/1", root);
+    if (__real_mkdir(path, 0777))  return -1;
+    snprintf(path, sizeof(path), "%s/1/Photos & Videos", root);
+    if (__real_mkdir(path, 0777))  return -1;
+    for (int a = 0; a < albums; a++) {
+        snprintf(path, sizeof(path), "%s/1/Photos & Videos/Album%03d", root, a);
+        if (__real_mkdir(path, 0777))  return -1;
+    }
+    for (int f = first; f < first + files; f++) {
+        int video = f % 20 == 19, caption = f % 20 == 9;
+        size_t fsize = ((video ? size * 10 : size) / 2 + (size_t)f * 7919 % (video ? size * 10 : size)) / (caption ? 4 : 1) + variant;
+        snprintf(path, sizeof(path), "%s/1/Photos & Videos/Album%03d/%s_%05d.%s",
+                root, f % albums, video ? "video" : "photo", f, video ? "3gp" : caption ? "jpg.amr" : "jpg");
+        if (writeFile(path, fsize, f + (uint64_t)variant * 1000003) < 0)  return -1;
+    }
+    return 0;
+}
+
+/*
+ * Count the regular files below path, to check that each file of each device was fetched.
+ */
+static unsigned long countFiles(const char *path) {
+    DIR *dir;
+    struct dirent *entry;
+    unsigned long count = 0;
+    if (!(dir = __real_opendir(path)))  return 0;
+    while ((entry = readdir(dir))) {
+        char sub[1024];
+        struct stat st;
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))  continue;
+        snprintf(sub, sizeof(sub), "%s/%s", path, entry->d_name);
+        if (__real_stat(sub, &st))  continue;
+        count += S_ISDIR(st.st_mode) ? countFiles(sub) : S_ISREG(st.st_mode);
+    }
+    closedir(dir);
+    return count;
+}
+
+static void *syncDevice(void *sd) {
+    return (void *)(intptr_t)plugin_sync((intptr_t)sd);
+}
+
+/*
+ * Sync the devices with socket descriptors 0 .. devices - 1, each by its own thread.
+ */
+static int runSync(const char *label, int files, int devices, int verbose) {
+    unsigned long long bytes = mockStat.bytes;
+    unsigned long calls[MOCK_CALLS], dlpCalls = 0, reads = mockStat.reads;
+    memcpy(calls, mockStat.calls, sizeof(calls));
+    syscalls = 0;
+    unsigned long io = ioSyscalls();
+    double start = now();
+
+    int result = plugin_startup(NULL);
+    if (!result)  result = plugin_pre_sync_pre_connect() || plugin_pre_sync();
+    if (!result && devices == 1) {
+        result = plugin_sync(0);
+    } else if (!result) {
+        pthread_t threads[devices];
+        int started = 0;
+        for (; started < devices; started++) {
+            if (pthread_create(&threads[started], NULL, syncDevice, (void *)(intptr_t)started))  break;
+        }
+        result = started < devices;
+        for (int i = 0; i < started; i++) {
+            void *syncResult;
+            if (pthread_join(threads[i], &syncResult) || syncResult)  result = 1;
+        }
+    }
+    if (plugin_post_sync())  result = 1;
+    plugin_exit_cleanup();
+
+    double wall = now() - start;
+    unsigned long local = syscalls + ioSyscalls() - io - (mockStat.reads - reads);
+    for (int i = 0; i < MOCK_CALLS; i++)  dlpCalls += mockStat.calls[i] - calls[i];
+    printf("%6d  %-7s  %9.3f  %9lu  %12llu  %9lu  %s\n",
+            files * devices, label, wall, dlpCalls, mockStat.bytes - bytes, local, result ? "FAILED" : "ok");
+    fflush(stdout);
+    if (verbose) {
+        for (int i = 0; i < MOCK_CALLS; i++) {
+            if (mockStat.calls[i] - calls[i])  printf("%30s: %lu\n", mockCallName(i), mockStat.calls[i] - calls[i]);
+        }
+    }
+    return result;
+}
+
+static int bench(int files, int albums, size_t size, const mockConfig *config, int resyncs, int devices, int sameNames, int keep, int verbose) {
+    char dir[] = "/tmp/picsnvideos-bench-XXXXXX", path[sizeof(dir) + 16];
+    int result = 0;
+
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    for (int d = 0; d < devices; d++) {
+        // The first device keeps the path of a single device bench.
+        if (d)  snprintf(path, sizeof(path), "%s/device%d", dir, d);
+        else  snprintf(path, sizeof(path), "%s/device", dir);
+        if (__real_mkdir(path, 0777) ||
+                createDevice(path, sameNames ? 0 : d * files, files, albums ? albums : files / 100 + 1, size, sameNames ? d : 0) < 0) {
+            perror("creating synthetic device");
+            return EXIT_FAILURE;
+        }
+        if ((d ? mockAddDevice(path) : mockInit(path, config)) != d) {
+            fprintf(stderr, "Too many devices for the mock\n");
+            return EXIT_FAILURE;
+        }
+    }
+    snprintf(path, sizeof(path), "%s/.jpilot", dir);
+    __real_mkdir(path, 0777);
+    if (sameNames) {
+        // Trust the manifest, so a file would be missed, if it was taken for the one of another device.
+        FILE *prefs;
+        snprintf(path, sizeof(path), "%s/.jpilot/picsnvideos.rc", dir);
+        if (!(prefs = __real_fopen(path, "w")) || fputs("skipKnownFiles 1\n", prefs) < 0 || __real_fclose(prefs)) {
+            perror("writing prefs");
+            return EXIT_FAILURE;
+        }
+    }
+    setenv("JPILOT_HOME", dir, 1);
+
+    snprintf(path, sizeof(path), "%s/.jpilot/"PCDIR, dir);
+    for (int i = 0; i <= resyncs; i++) {
+        unsigned long sized = mockStat.calls[MOCK_FILE_SIZE];
+        result |= runSync(i ? "resync" : "fetch", files, devices, verbose);
+        // The albums are unchanged after the first sync, so skipped without opening a file for its size.
+        if (i && mockStat.calls[MOCK_FILE_SIZE] != sized) {
+            printf("# FAILED: %lu files checked again, expected all albums skipped\n", mockStat.calls[MOCK_FILE_SIZE] - sized);
+            result = 1;
+        }
+        // Each file of each device is fetched once, and then found unchanged.
+        unsigned long fetched = countFiles(path);
+        if (fetched != (unsigned long)files * devices) {
+            printf("# FAILED: %lu files in '%s', expected %d\n", fetched, path, files * devices);
+            result = 1;
+        }
+    }
+
+    if (keep) {
+        fprintf(stderr, "Kept '%s'\n", dir);
+    } else {
+        char cmd[sizeof(dir) + 16];
+        snprintf(cmd, sizeof(cmd), "rm -rf '%s'", dir);
+        result |= system(cmd);
+    }
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    static const int SWEEP[] = {10, 100, 1000, 10000};
+    mockConfig config = {0, 0, 0, 0};
+    int files = 0, albums = 0, resyncs = 1, devices = 1, sameNames = 0, keep = 0, verbose = 0, opt, result = 0;
+    size_t size = 20000;
+
+    while ((opt = getopt(argc, argv, "f:a:s:l:b:q:r:d:ckvh")) != -1) {
+        switch (opt) {
+            case 'f': files = atoi(optarg); break;
+            case 'a': albums = atoi(optarg); break;
+            case 's': size = atol(optarg); break;
+            case 'l': config.latency = atol(optarg); break;
+            case 'b': config.bandwidth = atol(optarg); break;
+            case 'q': config.quirks = atoi(optarg); break;
+            case 'r': resyncs = atoi(optarg); break;
+            case 'd': devices = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+            case 'c': sameNames = 1; break;
+            case 'k': keep = 1; break;
+            case 'v': verbose = 1; break;
+            default:
+                fputs(USAGE, stderr);
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    glob_log_stdout_mask = verbose ? 0xffff : JP_LOG_FATAL;
+    printf("# latency=%ldus bandwidth=%ldB/s quirks=%d size=%zu devices=%d%s\n", config.latency, config.bandwidth, config.quirks, size, devices,
+            sameNames ? " same names" : "");
+    printf("%6s  %-7s  %9s  %9s  %12s  %9s\n", "files", "sync", "wall[s]", "DLP calls", "bytes", "syscalls");
+    fflush(stdout);
+    for (int i = 0; i < (files ? 1 : sizeof(SWEEP)/sizeof(*SWEEP)); i++) {
+        // Run each size in its own process, as the plugin is started only once per process in JPilot too.
+        pid_t pid;
+        int status;
+        if (!(pid = fork()))  exit(bench(files ? files : SWEEP[i], albums, size, &config, resyncs, devices, sameNames, keep, verbose));
+        if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))  result = 1;
+    }
+    return result ? EXIT_FAILURE : EXIT_SUCCESS;
+}
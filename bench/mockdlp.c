@@ -0,0 +1,413 @@
+/*******************************************************************************
+ * mockdlp.c
+ *
+ * Stand-in for the pilot-link VFS calls used by picsnvideos, serving a
+ * directory tree on disk as Palm volumes. For benchmarks only.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ******************************************************************************/
+
+/*
+ * Each subdirectory "<root>/<volRef>" is a volume. Volume 1 is the hidden
+ * internal TFFS volume, as on the Treo and Centro, all others are SDCards.
+ * Every call sleeps the configured latency, reads additionally sleep the
+ * time the configured bandwidth needs for the transferred bytes.
+ * Several devices can be served, each by its own socket descriptor, which
+ * may be used by one thread at a time. The statistics are of all devices.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <pi-dlp.h>
+
+#include "mockdlp.h"
+
+#define MAX_REFS 64
+#define MAX_DEVICES 16
+
+typedef struct mockRef {
+    int fd;           // file, or -1
+    char **names;     // sorted directory entries
+    unsigned long *attrs;
+    int count;
+    char path[1024];
+} mockRef;
+
+typedef struct mockDevice {
+    char root[512];
+    mockRef refs[MAX_REFS];
+} mockDevice;
+
+static mockDevice devices[MAX_DEVICES];
+static int deviceCount;
+static mockConfig config;
+static pthread_mutex_t statLock = PTHREAD_MUTEX_INITIALIZER; // guards mockStat and config.failAfter
+mockStats mockStat;
+
+static const char *CALL_NAMES[MOCK_CALLS] = {
+    "VolumeEnumerate", "VolumeInfo", "VolumeSize", "FileOpen", "FileClose", "FileRead",
+    "FileSeek", "FileTell", "FileSize", "FileGetDate", "DirEntryEnumerate", "ReadUserInfo"
+};
+
+const char *mockCallName(int call) {
+    return CALL_NAMES[call];
+}
+
+static void delay(long usec) {
+    if (usec <= 0)  return;
+    struct timespec ts = {usec / 1000000, usec % 1000000 * 1000};
+    while (nanosleep(&ts, &ts) && errno == EINTR);
+}
+
+/*
+ * Count the call with its transferred bytes, and return the bytes transferred by all calls so far.
+ */
+static unsigned long long account(int call, size_t bytes) {
+    unsigned long long total;
+    pthread_mutex_lock(&statLock);
+    mockStat.calls[call]++;
+    total = mockStat.bytes += bytes;
+    pthread_mutex_unlock(&statLock);
+    delay(config.latency + (config.bandwidth ? (long)(bytes * 1000000.0 / config.bandwidth) : 0));
+    return total;
+}
+
+int mockInit(const char *root, const mockConfig *cfg) {
+    config = *cfg;
+    memset(&mockStat, 0, sizeof(mockStat));
+    deviceCount = 0;
+    return mockAddDevice(root);
+}
+
+int mockAddDevice(const char *root) {
+    if (deviceCount == MAX_DEVICES)  return -1;
+    mockDevice *device = &devices[deviceCount];
+    snprintf(device->root, sizeof(device->root), "%s", root);
+    for (int i = 0; i < MAX_REFS; i++)  device->refs[i].fd = -2; // free
+    return deviceCount++;
+}
+
+static mockDevice *getDevice(int sd) {
+    return sd >= 0 && sd < deviceCount ? &devices[sd] : NULL;
+}
+
+static mockRef *getRef(int sd, FileRef fileRef) {
+    mockDevice *device;
+    if (!(device = getDevice(sd)) || fileRef < 1 || fileRef > MAX_REFS || device->refs[fileRef - 1].fd == -2)  return NULL;
+    return &device->refs[fileRef - 1];
+}
+
+static int cmpNames(const void *a, const void *b) {
+    return strcmp(*(char **)a, *(char **)b);
+}
+
+/*
+ * Not by opendir(), as the bench counts that as a local syscall of the engine.
+ */
+static DIR *openDir(const char *path) {
+    int fd;
+    DIR *dir;
+    if ((fd = open(path, O_RDONLY | O_DIRECTORY)) < 0)  return NULL;
+    if (!(dir = fdopendir(fd)))  close(fd);
+    return dir;
+}
+
+static int readDir(mockRef *ref) {
+    DIR *dir;
+    struct dirent *entry;
+    int size = 0;
+
+    if (!(dir = openDir(ref->path)))  return -1;
+    while ((entry = readdir(dir))) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))  continue;
+        if (ref->count == size) {
+            size = size ? size * 2 : 64;
+            ref->names = realloc(ref->names, size * sizeof(*ref->names));
+        }
+        ref->names[ref->count++] = strdup(entry->d_name);
+    }
+    closedir(dir);
+    qsort(ref->names, ref->count, sizeof(*ref->names), cmpNames);
+    ref->attrs = calloc(ref->count + 1, sizeof(*ref->attrs));
+    for (int i = 0; i < ref->count; i++) {
+        char path[1024];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", ref->path, ref->names[i]);
+        if (!fstatat(AT_FDCWD, path, &st, 0) && S_ISDIR(st.st_mode))  ref->attrs[i] |= vfsFileAttrDirectory;
+        if (ref->names[i][0] == '.')  ref->attrs[i] |= vfsFileAttrHidden;
+    }
+    return 0;
+}
+
+/*
+ * The user of a device is named by the last component of its root, without user ID, as a device never synced.
+ */
+PI_ERR dlp_ReadUserInfo(int sd, struct PilotUser *user) {
+    mockDevice *device;
+    account(MOCK_READ_USER_INFO, 0);
+    if (!(device = getDevice(sd)))  return -1;
+    const char *name = strrchr(device->root, '/');
+    memset(user, 0, sizeof(*user));
+    snprintf(user->username, sizeof(user->username), "%s", name ? name + 1 : device->root);
+    return 0;
+}
+
+PI_ERR dlp_VFSVolumeEnumerate(int sd, int *numVols, int *volRefs) {
+    mockDevice *device;
+    int found = 0;
+    account(MOCK_VOLUME_ENUMERATE, 0);
+    if (!(device = getDevice(sd)))  return -1;
+    for (int volRef = 2; volRef < 64 && found < *numVols; volRef++) {
+        char path[600];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%d", device->root, volRef);
+        if (!fstatat(AT_FDCWD, path, &st, 0) && S_ISDIR(st.st_mode))  volRefs[found++] = volRef;
+    }
+    *numVols = found;
+    return found ? found * 2 : -301; // like the Treo 650
+}
+
+PI_ERR dlp_VFSVolumeInfo(int sd, int volRefNum, struct VFSInfo *volInfo) {
+    mockDevice *device;
+    char path[600];
+    struct stat st;
+    account(MOCK_VOLUME_INFO, 0);
+    if (!(device = getDevice(sd)))  return -1;
+    snprintf(path, sizeof(path), "%s/%d", device->root, volRefNum);
+    if (fstatat(AT_FDCWD, path, &st, 0) || !S_ISDIR(st.st_mode))  return -1;
+    memset(volInfo, 0, sizeof(*volInfo));
+    volInfo->attributes = volRefNum == 1 ? vfsVolAttrHidden : vfsVolAttrSlotBased;
+    volInfo->mediaType = volRefNum == 1 ? pi_mktag('T', 'F', 'F', 'S') : pi_mktag('s', 'd', 'i', 'g');
+    volInfo->slotRefNum = volRefNum - 1;
+    return 0;
+}
+
+static long duTree(const char *path) {
+    DIR *dir;
+    struct dirent *entry;
+    long sum = 0;
+    if (!(dir = openDir(path)))  return 0;
+    while ((entry = readdir(dir))) {
+        char sub[1024];
+        struct stat st;
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))  continue;
+        snprintf(sub, sizeof(sub), "%s/%s", path, entry->d_name);
+        if (fstatat(AT_FDCWD, sub, &st, 0))  continue;
+        sum += S_ISDIR(st.st_mode) ? 4096 + duTree(sub) : (st.st_size + 4095) / 4096 * 4096;
+    }
+    closedir(dir);
+    return sum;
+}
+
+PI_ERR dlp_VFSVolumeSize(int sd, int volRefNum, long *volSizeUsed, long *volSizeTotal) {
+    mockDevice *device;
+    char path[600];
+    account(MOCK_VOLUME_SIZE, 0);
+    if (!(device = getDevice(sd)))  return -1;
+    snprintf(path, sizeof(path), "%s/%d", device->root, volRefNum);
+    *volSizeUsed = duTree(path);
+    *volSizeTotal = 1L << 30;
+    return 0;
+}
+
+PI_ERR dlp_VFSFileOpen(int sd, int volRefNum, const char *path, int openMode, FileRef *fileRef) {
+    mockDevice *device;
+    struct stat st;
+    int i;
+    account(MOCK_FILE_OPEN, 0);
+    if (!(device = getDevice(sd)))  return -1;
+    for (i = 0; i < MAX_REFS && device->refs[i].fd != -2; i++);
+    if (i == MAX_REFS)  return -1;
+    mockRef *ref = &device->refs[i];
+    char refPath[sizeof(ref->path)];
+    // Formatted aside, as the root is in the same devices[] as the path of ref.
+    snprintf(refPath, sizeof(refPath), "%s/%d%s", device->root, volRefNum, path);
+    memset(ref, 0, sizeof(*ref));
+    strcpy(ref->path, refPath);
+    if (fstatat(AT_FDCWD, ref->path, &st, 0)) {
+        ref->fd = -2; // keep it free
+        return -1;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        ref->fd = -1;
+        if (readDir(ref) < 0) {
+            ref->fd = -2;
+            return -1;
+        }
+    } else {
+        if ((ref->fd = open(ref->path, O_RDONLY)) < 0) {
+            ref->fd = -2;
+            return -1;
+        }
+    }
+    *fileRef = i + 1;
+    return 0;
+}
+
+PI_ERR dlp_VFSFileClose(int sd, FileRef fileRef) {
+    mockRef *ref;
+    account(MOCK_FILE_CLOSE, 0);
+    if (!(ref = getRef(sd, fileRef)))  return -1;
+    if (ref->fd >= 0) {
+        close(ref->fd);
+    }
+    for (int i = 0; i < ref->count; i++)  free(ref->names[i]);
+    free(ref->names);
+    free(ref->attrs);
+    ref->fd = -2;
+    return 0;
+}
+
+PI_ERR dlp_VFSFileRead(int sd, FileRef fileRef, pi_buffer_t *data, size_t numBytes) {
+    mockRef *ref;
+    ssize_t got;
+    unsigned long long total;
+    int fail = 0;
+    if (!(ref = getRef(sd, fileRef)) || ref->fd < 0) {
+        account(MOCK_FILE_READ, 0);
+        return -1;
+    }
+    pi_buffer_clear(data);
+    if (!pi_buffer_expect(data, numBytes))  return -1;
+    pthread_mutex_lock(&statLock);
+    mockStat.reads++;
+    pthread_mutex_unlock(&statLock);
+    if ((got = read(ref->fd, data->data, numBytes)) < 0)  return -1;
+    data->used = got;
+    total = account(MOCK_FILE_READ, got);
+    pthread_mutex_lock(&statLock);
+    if (config.failAfter && total > config.failAfter) {
+        config.failAfter = 0; // fail only once, like a flaky cradle
+        fail = 1;
+    }
+    pthread_mutex_unlock(&statLock);
+    return fail ? -1 : (PI_ERR)got;
+}
+
+PI_ERR dlp_VFSFileSeek(int sd, FileRef fileRef, int origin, int offset) {
+    mockRef *ref;
+    account(MOCK_FILE_SEEK, 0);
+    if (!(ref = getRef(sd, fileRef)) || ref->fd < 0)  return -1;
+    return lseek(ref->fd, offset, origin == vfsOriginEnd ? SEEK_END : origin == vfsOriginCurrent ? SEEK_CUR : SEEK_SET) < 0 ? -1 : 0;
+}
+
+PI_ERR dlp_VFSFileTell(int sd, FileRef fileRef, int *position) {
+    mockRef *ref;
+    account(MOCK_FILE_TELL, 0);
+    if (!(ref = getRef(sd, fileRef)) || ref->fd < 0)  return -1;
+    *position = lseek(ref->fd, 0, SEEK_CUR);
+    return 0;
+}
+
+PI_ERR dlp_VFSFileSize(int sd, FileRef fileRef, int *size) {
+    mockRef *ref;
+    struct stat st;
+    account(MOCK_FILE_SIZE, 0);
+    if (!(ref = getRef(sd, fileRef)) || ref->fd < 0)  return -1;
+    if (fstat(ref->fd, &st))  return -1;
+    *size = st.st_size;
+    return 0;
+}
+
+PI_ERR dlp_VFSFileGetDate(int sd, FileRef fileRef, int which, time_t *date) {
+    mockRef *ref;
+    struct stat st;
+    account(MOCK_FILE_GET_DATE, 0);
+    if (!(ref = getRef(sd, fileRef)))  return -1;
+    if (fstatat(AT_FDCWD, ref->path, &st, 0))  return -1;
+    *date = st.st_mtime;
+    return 0;
+}
+
+/*
+ * The iterator is the index of the next entry. Quirks as seen on real devices:
+ * MOCK_QUIRK_STOP_ON_FULL answers vfsIteratorStop, whenever the batch is filled up,
+ * even if more entries follow; MOCK_QUIRK_BOGUS_ITERATOR answers the out of range
+ * iterator 1888 after the first batch, which fails on continuation.
+ */
+PI_ERR dlp_VFSDirEntryEnumerate(int sd, FileRef dirRef, unsigned long *dirIterator, int *maxDirItems, struct VFSDirInfo *dirItems) {
+    mockRef *ref;
+    unsigned long itr = *dirIterator;
+    int n = 0;
+
+    account(MOCK_DIR_ENTRY_ENUMERATE, 0);
+    if (!(ref = getRef(sd, dirRef)) || ref->fd != -1)  return -1;
+    if (itr == 1888 && config.quirks & MOCK_QUIRK_BOGUS_ITERATOR)  return -1;
+    if (itr == (unsigned long)vfsIteratorStop || itr > (unsigned long)ref->count)  return -1;
+    for (; n < *maxDirItems && itr < (unsigned long)ref->count; n++, itr++) {
+        dirItems[n].attr = ref->attrs[itr];
+        snprintf(dirItems[n].name, sizeof(dirItems[n].name), "%s", ref->names[itr]);
+    }
+    pthread_mutex_lock(&statLock);
+    mockStat.bytes += n * sizeof(*dirItems);
+    pthread_mutex_unlock(&statLock);
+    delay(config.bandwidth ? (long)(n * sizeof(*dirItems) * 1000000.0 / config.bandwidth) : 0);
+    if (itr >= (unsigned long)ref->count || (n == *maxDirItems && config.quirks & MOCK_QUIRK_STOP_ON_FULL)) {
+        itr = (unsigned long)vfsIteratorStop;
+    } else if (config.quirks & MOCK_QUIRK_BOGUS_ITERATOR) {
+        itr = 1888;
+    }
+    *dirIterator = itr;
+    *maxDirItems = n;
+    return 0;
+}
+
+pi_buffer_t *pi_buffer_new(size_t capacity) {
+    pi_buffer_t *buf;
+    if (!(buf = malloc(sizeof(*buf))))  return NULL;
+    if (!(buf->data = malloc(capacity ? capacity : 1))) {
+        free(buf);
+        return NULL;
+    }
+    buf->allocated = capacity;
+    buf->used = 0;
+    return buf;
+}
+
+pi_buffer_t *pi_buffer_expect(pi_buffer_t *buf, size_t expect) {
+    if (buf->allocated - buf->used >= expect)  return buf;
+    unsigned char *data;
+    if (!(data = realloc(buf->data, buf->used + expect)))  return NULL;
+    buf->data = data;
+    buf->allocated = buf->used + expect;
+    return buf;
+}
+
+pi_buffer_t *pi_buffer_append(pi_buffer_t *buf, const void *data, size_t len) {
+    if (!pi_buffer_expect(buf, len))  return NULL;
+    memcpy(buf->data + buf->used, data, len);
+    buf->used += len;
+    return buf;
+}
+
+void pi_buffer_clear(pi_buffer_t *buf) {
+    buf->used = 0;
+}
+
+void pi_buffer_free(pi_buffer_t *buf) {
+    if (buf) {
+        free(buf->data);
+        free(buf);
+    }
+}
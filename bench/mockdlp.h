@@ -0,0 +1,62 @@
+/*******************************************************************************
+ * mockdlp.h
+ *
+ * Stand-in for the pilot-link VFS calls used by picsnvideos.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ******************************************************************************/
+
+#ifndef __MOCKDLP_H__
+#define __MOCKDLP_H__
+
+#include <stddef.h>
+
+enum {
+    MOCK_VOLUME_ENUMERATE, MOCK_VOLUME_INFO, MOCK_VOLUME_SIZE, MOCK_FILE_OPEN, MOCK_FILE_CLOSE, MOCK_FILE_READ,
+    MOCK_FILE_SEEK, MOCK_FILE_TELL, MOCK_FILE_SIZE, MOCK_FILE_GET_DATE, MOCK_DIR_ENTRY_ENUMERATE, MOCK_READ_USER_INFO,
+    MOCK_CALLS
+};
+
+// Iterator bugs of dlp_VFSDirEntryEnumerate(), see <https://github.com/juddmon/jpilot/issues/41>
+#define MOCK_QUIRK_STOP_ON_FULL   1 // vfsIteratorStop after a full batch, even if more entries follow
+#define MOCK_QUIRK_BOGUS_ITERATOR 2 // iterator 1888 after the first batch, continuing fails
+
+typedef struct {
+    long latency;     // usec per call
+    long bandwidth;   // bytes/s, 0 = unlimited
+    int quirks;       // MOCK_QUIRK_*
+    size_t failAfter; // let one read fail after that many bytes, 0 = never
+} mockConfig;
+
+typedef struct {
+    unsigned long calls[MOCK_CALLS];
+    unsigned long long bytes;
+    unsigned long reads; // read(2) calls done by the mock itself
+} mockStats;
+
+extern mockStats mockStat;
+
+/*
+ * Serve the volumes found in root as device with socket descriptor 0, see mockdlp.c.
+ */
+int mockInit(const char *root, const mockConfig *config);
+/*
+ * Serve the volumes found in root as another device.
+ * Returns its socket descriptor, or -1 if there are too many devices.
+ */
+int mockAddDevice(const char *root);
+const char *mockCallName(int call);
+
+#endif
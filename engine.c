@@ -0,0 +1,3699 @@
+/*******************************************************************************
+ * engine.c
+ *
+ * The fetch engine of picsnvideos, used by the JPilot plugin and by the
+ * picsnvideos-sync tool.
+ *
+ * Copyright (C) 2008 by Dan Bodoh
+ * Contributor (2022): Ulf Zibis <Ulf.Zibis@CoSoCo.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ******************************************************************************/
+
+#include "config.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <pi-dlp.h>
+#include <pi-source.h>
+#include <pi-util.h>
+
+#include "libplugin.h"
+#include "engine.h"
+
+typedef struct VFSInfo VFSInfo;
+typedef struct VFSDirInfo VFSDirInfo;
+enum {RULE_TYPE, RULE_INCLUDE, RULE_EXCLUDE, RULE_KINDS};
+typedef struct filterRule {
+    struct filterRule *next; // in the same bucket, or in globs
+    int kind;
+    long minSize, maxSize; // bytes, maxSize < 0 = unlimited
+    char pattern[]; // lower case
+} filterRule;
+#define FILTER_BUCKETS 64
+typedef struct nameFilter {
+    filterRule *buckets[FILTER_BUCKETS]; // rules without wildcards and of the form "*.ext", by pattern
+    filterRule *globs; // the other rules
+    unsigned rules[RULE_KINDS];
+    int sized; // some rule has a size range
+} nameFilter;
+enum {FILTER_SKIP, FILTER_TAKE, FILTER_SIZE};
+#define ROOT_LEVELS 8
+typedef struct rootPattern {
+    struct rootPattern *next;
+    unsigned levels; // components matched by globs below path
+    unsigned nameOffset; // of the album names in the paths of the dirs below path
+    const char *parts[ROOT_LEVELS]; // the globs, lower case
+    char path[]; // the part without wildcards, followed by the globs
+} rootPattern;
+enum {
+    TRACE_ENUMERATE, TRACE_ENUMERATE_RESTART, TRACE_ENUMERATE_OK, TRACE_DIR_QUEUED, TRACE_DIR_MISMATCH, TRACE_ALBUM_FILTERED,
+    TRACE_ALBUM_UNCHANGED, TRACE_ALBUM_PLANNED, TRACE_FILE_FOUND, TRACE_FILE_KNOWN, TRACE_FILE_FILTERED, TRACE_FILE_EXISTS, TRACE_FILE_DATE_CHANGED,
+    TRACE_FILE_DONE, TRACE_FILE_LINKED, TRACE_IDS
+};
+typedef struct manifestEntry {
+    struct manifestEntry *next;
+    struct manifestEntry *sameSize; // chain in contentIndex
+    uint32_t hash;
+    uint32_t size;
+    time_t date;
+    uint64_t digest; // XXH64 of the content, if hasDigest
+    int hasDigest;
+    char *dst; // relative to PCDIR, stored behind key
+    char key[];
+} manifestEntry;
+typedef struct manifestInfo { // copy of a manifestEntry, to be used without holding manifestLock
+    uint32_t size;
+    time_t date;
+    uint64_t digest;
+    int hasDigest;
+    char dst[256];
+} manifestInfo;
+typedef struct albumPrint {
+    struct albumPrint *next;
+    time_t date, dstDate; // modified dates of the album dir on the Palm and of its backup dir
+    uint32_t dstNsec; // nanoseconds of dstDate, 0 if unknown
+    int64_t volumeUsed; // used bytes of its volume, -1 = invalid
+    uint32_t files, rechecks; // media files in the album, and of them of quickCheckTypes
+    uint64_t captions; // sum of captionSum() over the files of quickCheckTypes
+    uint32_t dirs; // subdirs walked, ALBUM_DIRS_UNKNOWN if recorded by an older version
+    char key[]; // followed by the backup dir, while waiting in syncSession.donePrints
+} albumPrint;
+#define ALBUM_DIRS_UNKNOWN UINT32_MAX
+typedef struct xxh64State {
+    uint64_t total, v[4];
+    unsigned char mem[32];
+    unsigned memSize;
+} xxh64State;
+typedef struct dirIndex {
+    unsigned size, count; // size is a power of 2
+    char **names; // open addressing, NULL = free slot
+} dirIndex;
+typedef struct pathClaim {const char *path; struct pathClaim *next;} pathClaim;
+typedef struct localEntry {
+    struct localEntry *next; // chain in the buckets
+    struct localEntry *sibling, *children; // the entries of a directory
+    off_t size;
+    time_t mtime;
+    long mtimeNsec;
+    mode_t mode;
+    char path[];
+} localEntry;
+typedef struct localIndex {
+    unsigned size, count; // size is a power of 2
+    localEntry **buckets;
+} localIndex;
+typedef struct deferredJob {
+    struct deferredJob *next;
+    syncSession *session;
+    struct albumStats *album;
+    uint32_t size;
+    time_t date;
+    uint64_t digest;
+    int link; // link to identical content fetched before
+    int linked;
+    int failed; // could not be renamed from its part file
+    pathClaim claim; // of path, held until renamed to it
+    double secs;
+    char *key;
+    char path[];
+} deferredJob;
+typedef struct deferredBatch {
+    struct deferredBatch *next;
+    syncSession *session;
+    deferredJob *files; // fetched to one album, to be synced to disk together
+} deferredBatch;
+#define VOLUME_CACHE 16
+typedef struct volumeCache {
+    int volRef;
+    int hasInfo, hasUsed;
+    VFSInfo info;
+    long used; // bytes
+} volumeCache;
+typedef struct plannedAlbum {
+    struct plannedAlbum *next;
+    unsigned volRef;
+    const char *device; // of the session
+    char card[16];
+    char *dstAlbumDir; // NULL, when done
+    dirIndex dstIndex; // names in dstAlbumDir
+    int indexed; // dstIndex: 0 = not yet read, 1 = read, -1 = could not be read
+    int result;
+    unsigned files, rechecks; // media files found, and of them of quickCheckTypes
+    uint64_t captions; // sum of captionSum() over the files of quickCheckTypes
+    unsigned dirs; // subdirs queued for the walk
+    unsigned pending; // planned files not yet done
+    int fingerprint; // date and used are valid, so the album can be fingerprinted when done
+    time_t date;
+    int64_t used;
+    struct albumStats *stats;
+    char srcAlbumDir[];
+} plannedAlbum;
+typedef struct plannedFile {
+    plannedAlbum *album;
+    unsigned index; // in order of planning
+    int size;
+    time_t date; // 0 = unknown
+    long long rank; // by pref syncOrder, lower first
+    char name[];
+} plannedFile;
+typedef struct syncPlan {
+    plannedFile **files;
+    unsigned count, allocated;
+    plannedAlbum *albums;
+    long long bytes;
+    double deadline; // to stop fetching, 0 = none
+} syncPlan;
+typedef struct walkDir {
+    struct walkDir *next;
+    unsigned level; // components below the path of its root pattern
+    char path[];
+} walkDir;
+typedef struct walkContext {
+    syncSession *session;
+    syncPlan *plan;
+    unsigned volRef;
+    const rootPattern *root;
+    walkDir *queue, **tail; // dirs found, but not yet enumerated
+    const walkDir *dir; // being enumerated
+    plannedAlbum *album; // to plan the files of dir for, or NULL
+    unsigned dirs; // subdirs of dir queued
+} walkContext;
+#define PIPE_BUFFERS 3
+typedef struct copyPipe {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    FILE *stream;
+    pi_buffer_t **bufs; // of the session
+    int head, count; // ring of filled buffers in bufs[]
+    int done, error;
+    long written;
+    double writeSecs;
+    xxh64State *digest; // of the written bytes, if not NULL
+} copyPipe;
+#define CHUNK_CANDIDATES 5
+typedef struct chunkTuner {
+    int candidate; // index into CHUNK_SIZES, which is probed now
+    long bytes[CHUNK_CANDIDATES];
+    double secs[CHUNK_CANDIDATES];
+} chunkTuner;
+typedef int (*dirEntryHandler)(const VFSDirInfo *dirInfos, int count, void *ctx);
+enum {PHASE_ENUMERATE, PHASE_OPEN, PHASE_SIZE, PHASE_COMPARE, PHASE_READ, PHASE_WRITE, PHASE_SET_DATE, PHASES, PHASE_NONE = -1};
+enum {
+    DLP_VOLUME_ENUMERATE, DLP_VOLUME_INFO, DLP_VOLUME_SIZE, DLP_FILE_OPEN, DLP_FILE_CLOSE, DLP_FILE_READ, DLP_FILE_SEEK,
+    DLP_FILE_SIZE, DLP_FILE_GET_DATE, DLP_DIR_ENTRY_ENUMERATE, DLP_READ_USER_INFO, DLP_CALLS
+};
+#define LATENCY_BUCKETS 24 // bucket i counts latencies < 2^i usec, the last one all above
+typedef struct phaseStats {
+    unsigned long count;
+    double secs;
+    unsigned long long bytes;
+} phaseStats;
+typedef struct dlpStats {
+    unsigned long count, errors;
+    double secs;
+    unsigned long latency[LATENCY_BUCKETS];
+} dlpStats;
+typedef struct albumStats {
+    struct albumStats *next;
+    unsigned volRef;
+    char card[16];
+    unsigned long files, fetched, linked, failed; // files matching the file types, fetched, linked or failed of them
+    unsigned long long bytes;
+    double secs;
+    char name[];
+} albumStats;
+typedef struct syncStats {
+    time_t date;
+    double start, secs;
+    phaseStats phases[PHASES];
+    dlpStats dlp[DLP_CALLS];
+    albumStats *albums, **lastAlbum, *album; // album is the one being fetched
+    double albumStart;
+    unsigned long leftFiles; // planned, but not fetched due to the sync limits
+    unsigned long long leftBytes;
+} syncStats;
+struct syncConfig {
+    long synchThumbnailsAlbum, compareContent, chunkSize, statsReport, dedupLinks, quickCheck, skipUnchangedAlbums;
+    long syncOrder, dryRun, syncTimeLimit, syncByteLimit, traceDump, albumDepth, skipKnownFiles;
+    const char *fileTypes, *fullCompareTypes, *quickCheckTypes, *albumFilterRules, *fileFilterRules, *rootDirRules;
+    rootPattern *roots; // compiled from rootDirRules
+    nameFilter albumFilter, fileFilter; // compiled from fileTypes, synchThumbnailsAlbum and the filter rules
+    uint32_t filterPrint;
+    int filterChanged; // since the last sync, so the album fingerprints don't tell about the files to fetch
+};
+/*
+ * The state of one sync with one device, so several devices can be synced at once by separate threads.
+ * They share the config, the manifest and the PREFS, which are guarded by locks.
+ */
+struct syncSession {
+    int sd;
+    const syncConfig *config;
+    char pcPath[256];
+    char device[40]; // the user ID or name of the device, keying its files in the manifest, "" if unknown
+    pi_buffer_t *palmBuf, *pcBuf, *pipeBufs[PIPE_BUFFERS];
+    syncStats stats;
+    // Valid during one sync, as the cards can be changed between syncs.
+    volumeCache volumeInfos[VOLUME_CACHE];
+    unsigned volumeInfoCount;
+    dirIndex ensuredDirs; // directories on the PC, which are known to exist
+    const localIndex *local; // the Media folder as scanned by engineWarmUp(), or NULL
+    double dlpStart;
+    int result; // of sessionSync(), -1 if it stopped before planning
+    deferredJob *unsynced; // files fetched, but not yet queued in a batch
+    unsigned deferred; // batches queued by this session, but not yet done
+    deferredJob *deferredDone; // done jobs, to be accounted by sessionFinish()
+    albumPrint *donePrints; // of the albums done, to be recorded by sessionFinish() after their batches
+    double syncSecs; // spent by the batches on syncing to disk
+};
+
+static const unsigned MAX_VOLUMES = 16;
+static const unsigned DIR_BATCH_ITEMS = 64;
+static const unsigned MAX_ALBUM_DEPTH = 16;
+static const double WARM_MAX_AGE = 30; // seconds from finishing to scan the Media folder to a sync using it
+static const char *PREFS_FILE = "picsnvideos.rc";
+static const char *MANIFEST_FILE = "picsnvideos.manifest";
+static const char MANIFEST_MAGIC[8] = "PNVMANI1";
+enum {MANIFEST_FILE_ENTRY = 1, MANIFEST_CONTENT_DIGEST, MANIFEST_ALBUM_PRINT};
+static const int CHUNK_SIZES[CHUNK_CANDIDATES] = {4096, 8192, 16384, 32768, 65536};
+static const int DEFAULT_CHUNK_SIZE = 65536;
+static const long CHUNK_PROBE_BYTES = 131072; // per candidate
+static const int SAMPLE_SIZE = 4096; // bytes per block of a sampled compare
+static const int SAMPLE_BLOCKS = 4; // blocks between head and tail for compareContent=2
+static const char *VIDEO_TYPES = ".3gp.3g2";
+static const char *UNFILED_ALBUM = "Unfiled"; // name of the root dir for pref albumFilter
+static const double PROGRESS_SECS = 10; // between progress logs
+enum {ORDER_FOUND, ORDER_NEWEST, ORDER_PHOTOS, ORDER_SMALLEST};
+static const char *STATS_FILE = "picsnvideos-stats.json";
+static const char *STATS_HISTORY_FILE = "picsnvideos-stats.csv";
+static const char *TRACE_FILE = "picsnvideos-trace.txt";
+static const char *PHASE_NAMES[PHASES] = {"enumerate", "open", "size", "compare", "read", "write", "setDate"};
+static const char *DLP_NAMES[DLP_CALLS] = {
+    "VFSVolumeEnumerate", "VFSVolumeInfo", "VFSVolumeSize", "VFSFileOpen", "VFSFileClose", "VFSFileRead", "VFSFileSeek",
+    "VFSFileSize", "VFSFileGetDate", "VFSDirEntryEnumerate", "ReadUserInfo"
+};
+enum {
+    PREF_SYNCH_THUMBNAILS, PREF_FILE_TYPES, PREF_COMPARE_CONTENT, PREF_CHUNK_SIZE, PREF_TUNED_CHUNK_SIZES, PREF_STATS_REPORT,
+    PREF_DEDUP_LINKS, PREF_FULL_COMPARE_TYPES, PREF_QUICK_CHECK, PREF_QUICK_CHECK_TYPES, PREF_SKIP_UNCHANGED_ALBUMS,
+    PREF_SYNC_ORDER, PREF_DRY_RUN, PREF_SYNC_TIME_LIMIT, PREF_SYNC_BYTE_LIMIT, PREF_ALBUM_FILTER, PREF_FILE_FILTER,
+    PREF_FILTER_PRINT,
+    PREF_TRACE_DUMP, PREF_ROOT_DIRS, PREF_ALBUM_DEPTH, PREF_SKIP_KNOWN_FILES
+};
+static prefType PREFS[] = {
+    {"synchThumbnailsAlbum", INTTYPE, INTTYPE, 0, NULL, 0},
+    // JPEG picture
+    // video (GSM phones)
+    // video (CDMA phones)
+    // audio caption (GSM phones)
+    // audio caption (CDMA phones)
+    {"fileTypes", CHARTYPE, CHARTYPE, 0, ".jpg.3gp.3g2.amr.qcp" , 256},
+    {"compareContent", INTTYPE, INTTYPE, 0, NULL, 0},
+    // bytes per DLP read; 0 = tune automatically per card
+    {"chunkSize", INTTYPE, INTTYPE, 0, NULL, 0},
+    // results of automatic tuning, i.e. "Internal=32768;SDCard=65536"
+    {"tunedChunkSizes", CHARTYPE, CHARTYPE, 0, "", 256},
+    // write timings and DLP call statistics of each sync to picsnvideos-stats.json/.csv
+    {"statsReport", INTTYPE, INTTYPE, 1, NULL, 0},
+    // hard link files with content fetched before, instead of fetching and storing them again
+    {"dedupLinks", INTTYPE, INTTYPE, 0, NULL, 0},
+    // with compareContent=2, compare files of these types completely instead of by samples
+    {"fullCompareTypes", CHARTYPE, CHARTYPE, 0, ".amr.qcp", 256},
+    // without compareContent, a backup of the same size is unchanged only if the date is too;
+    // 1: check files of quickCheckTypes on each sync, the others only if not in the manifest, 2: check all files
+    {"quickCheck", INTTYPE, INTTYPE, 1, NULL, 0},
+    {"quickCheckTypes", CHARTYPE, CHARTYPE, 0, ".amr.qcp", 256},
+    // don't enumerate albums, whose dir, backup dir and volume size didn't change since the last sync
+    {"skipUnchangedAlbums", INTTYPE, INTTYPE, 1, NULL, 0},
+    // order to fetch the files in: 0 = as found, 1 = newest first, 2 = photos before videos, 3 = smallest first
+    {"syncOrder", INTTYPE, INTTYPE, 0, NULL, 0},
+    // only log the files, which would be checked on the Palm, but don't fetch them
+    {"dryRun", INTTYPE, INTTYPE, 0, NULL, 0},
+    // stop fetching after this many seconds or bytes, and continue on the next sync; 0 = no limit
+    {"syncTimeLimit", INTTYPE, INTTYPE, 0, NULL, 0},
+    {"syncByteLimit", INTTYPE, INTTYPE, 0, NULL, 0},
+    // albums to fetch by globs on their names separated by ';', "-" excluding, i.e. "Camera;Trip*" or "-Old*";
+    // the album of the files in the root folder is named "Unfiled"
+    {"albumFilter", CHARTYPE, CHARTYPE, 0, "", 256},
+    // files to fetch as albumFilter, each rule optionally limited by size in bytes, K or M, i.e. "-*.3g?>20M"
+    {"fileFilter", CHARTYPE, CHARTYPE, 0, "", 256},
+    // hash of fileTypes, synchThumbnailsAlbum and the filters of the last sync
+    {"filterPrint", INTTYPE, INTTYPE, 0, NULL, 0},
+    // write the trace of the last events to picsnvideos-trace.txt after each sync, not only after a failed one
+    {"traceDump", INTTYPE, INTTYPE, 0, NULL, 0},
+    // dirs on each volume to search for albums separated by ';', components after the first one with wildcards
+    // being globs, i.e. "/DCIM/1??*" for the folders of a camera
+    {"rootDirs", CHARTYPE, CHARTYPE, 0, "/Photos & Videos;/Fotos & Videos;/DCIM", 256},
+    // levels of nested albums to search below each root dir; 0 = only the files of the root dirs
+    {"albumDepth", INTTYPE, INTTYPE, 1, NULL, 0},
+    // don't open files on the Palm, which the manifest knows as fetched and whose backup exists, as set by quickCheck;
+    // saves the DLP calls of checking them, but a file replaced under the same name is not fetched again
+    {"skipKnownFiles", INTTYPE, INTTYPE, 0, NULL, 0}
+};
+static const unsigned NUM_PREFS = sizeof(PREFS)/sizeof(prefType);
+static syncConfig config; // read from PREFS on startup, the same for all sessions
+static int prefsDirty;
+static pthread_mutex_t prefsLock = PTHREAD_MUTEX_INITIALIZER; // guards PREFS and prefsDirty during syncs
+static manifestEntry **manifest = NULL;
+static manifestEntry **contentIndex = NULL; // the manifest entries by size, same number of buckets
+static unsigned manifestBuckets, manifestCount;
+static albumPrint *albumPrints = NULL; // fingerprints of the albums, kept in the manifest
+static int manifestDirty;
+static pthread_mutex_t manifestLock = PTHREAD_MUTEX_INITIALIZER; // guards all of the manifest above
+static pthread_mutex_t reportLock = PTHREAD_MUTEX_INITIALIZER; // serializes writing the statistics files
+// Sessions syncing several devices at once may fetch files of the same name to the same destination.
+static pathClaim *pathClaims; // the destination paths being fetched
+static dirIndex createdPaths; // destination paths created since the first of the running sessions began
+static unsigned runningSessions;
+static pthread_mutex_t claimLock = PTHREAD_MUTEX_INITIALIZER; // guards the claims above
+static pthread_cond_t claimReleased = PTHREAD_COND_INITIALIZER;
+// The Media folder scanned by a thread during the HotSync handshake, kept until the running sessions end.
+enum {WARM_NONE, WARM_RUNNING, WARM_READY};
+static localIndex warmIndex;
+static double warmDone; // monotonic time the scan of warmIndex finished
+static int warmState, warmJoinable;
+static pthread_t warmThread;
+static pthread_mutex_t warmLock = PTHREAD_MUTEX_INITIALIZER; // guards the above, locked after claimLock
+static pthread_cond_t warmFinished = PTHREAD_COND_INITIALIZER;
+// Local work after fetching a file, done by a pool of workers, while the session goes on with the device.
+#define DEFER_WORKERS 2
+static deferredBatch *deferQueue, **deferTail = &deferQueue;
+static pthread_t deferWorkers[DEFER_WORKERS];
+static int deferStarted, deferStop;
+static pthread_mutex_t deferLock = PTHREAD_MUTEX_INITIALIZER; // guards the queue and the deferred jobs of the sessions
+static pthread_cond_t deferQueued = PTHREAD_COND_INITIALIZER, deferFinished = PTHREAD_COND_INITIALIZER;
+
+int volumeEnumerateIncludeHidden(syncSession *, int *, int *);
+int planVolume(syncSession *, syncPlan *, int);
+int planFile(syncSession *, syncPlan *, plannedAlbum *, const char *);
+void planSort(syncPlan *);
+int planExecute(syncSession *, syncPlan *);
+void planReport(const syncPlan *);
+void planFree(syncPlan *);
+void albumDone(syncSession *, plannedAlbum *);
+int fileTypeListed(const char *, const char *);
+int manifestLoad(void);
+int manifestSave(void);
+void manifestFree(void);
+void albumPrintInvalidate(const char *);
+static void albumPrintRecord(const albumPrint *);
+static double monotonicSecs(void);
+static void sessionsRunning(int);
+static void releasePath(pathClaim *);
+static void deferShutdown(void);
+static void statsPhase(syncStats *, int, double, unsigned long long);
+static void deferWait(syncSession *);
+static void deferAlbumSync(syncSession *, const char *);
+static void deviceIdentify(syncSession *);
+static uint32_t strHash(const char *);
+int filterAdd(nameFilter *, int, const char *);
+int filterCompile(nameFilter *, const char *);
+int filterMatch(const nameFilter *, const char *, long);
+void filterFree(nameFilter *);
+int rootsCompile(rootPattern **, const char *);
+void rootsFree(rootPattern **);
+void statsBegin(syncStats *);
+int statsWrite(syncStats *, int);
+void statsFree(syncStats *);
+int dirIndexContains(const dirIndex *, const char *);
+int dirIndexAdd(dirIndex *, const char *);
+void dirIndexFree(dirIndex *);
+static const localEntry *localLookup(const localIndex *, const char *);
+static int localStat(const localIndex *, const char *, struct stat *);
+static void localFree(localIndex *);
+static void warmWait(void);
+
+/*
+ * Read the prefs into the config, which is shared by all sessions until engineCleanup().
+ * Returns the config, or NULL on error.
+ */
+const syncConfig *engineStartup(void) {
+    jp_pref_init(PREFS, NUM_PREFS);
+    if (jp_pref_read_rc_file(PREFS_FILE, PREFS, NUM_PREFS) < 0)
+        jp_logf(L_WARN, "%s: WARNING: Could not read PREFS from '%s'\n", MYNAME, PREFS_FILE);
+    if (jp_get_pref(PREFS, PREF_SYNCH_THUMBNAILS, &config.synchThumbnailsAlbum, NULL) < 0)
+        jp_logf(L_WARN, "%s: WARNING: Could not read pref '%s' from PREFS[]\n", MYNAME, PREFS[PREF_SYNCH_THUMBNAILS].name);
+    if (jp_get_pref(PREFS, PREF_FILE_TYPES, NULL, &config.fileTypes) < 0)
+        jp_logf(L_WARN, "%s: WARNING: Could not read pref '%s' from PREFS[]\n", MYNAME, PREFS[PREF_FILE_TYPES].name);
+    if (jp_get_pref(PREFS, PREF_COMPARE_CONTENT, &config.compareContent, NULL) < 0)
+        jp_logf(L_WARN, "%s: WARNING: Could not read pref '%s' from PREFS[]\n", MYNAME, PREFS[PREF_COMPARE_CONTENT].name);
+    if (jp_get_pref(PREFS, PREF_CHUNK_SIZE, &config.chunkSize, NULL) < 0)
+        jp_logf(L_WARN, "%s: WARNING: Could not read pref '%s' from PREFS[]\n", MYNAME, PREFS[PREF_CHUNK_SIZE].name);
+    if (jp_get_pref(PREFS, PREF_STATS_REPORT, &config.statsReport, NULL) < 0)
+        jp_logf(L_WARN, "%s: WARNING: Could not read pref '%s' from PREFS[]\n", MYNAME, PREFS[PREF_STATS_REPORT].name);
+    if (jp_get_pref(PREFS, PREF_DEDUP_LINKS, &config.dedupLinks, NULL) < 0)
+        jp_logf(L_WARN, "%s: WARNING: Could not read pref '%s' from PREFS[]\n", MYNAME, PREFS[PREF_DEDUP_LINKS].name);
+    if (jp_get_pref(PREFS, PREF_FULL_COMPARE_TYPES, NULL, &config.fullCompareTypes) < 0)
+        jp_logf(L_WARN, "%s: WARNING: Could not read pref '%s' from PREFS[]\n", MYNAME, PREFS[PREF_FULL_COMPARE_TYPES].name);
+    if (jp_get_pref(PREFS, PREF_QUICK_CHECK, &config.quickCheck, NULL) < 0)
+        jp_logf(L_WARN, "%s: WARNING: Could not read pref '%s' from PREFS[]\n", MYNAME, PREFS[PREF_QUICK_CHECK].name);
+    if (jp_get_pref(PREFS, PREF_QUICK_CHECK_TYPES, NULL, &config.quickCheckTypes) < 0)
+        jp_logf(L_WARN, "%s: WARNING: Could not read pref '%s' from PREFS[]\n", MYNAME, PREFS[PREF_QUICK_CHECK_TYPES].name);
+    if (jp_get_pref(PREFS, PREF_SKIP_UNCHANGED_ALBUMS, &config.skipUnchangedAlbums, NULL) < 0)
+        jp_logf(L_WARN, "%s: WARNING: Could not read pref '%s' from PREFS[]\n", MYNAME, PREFS[PREF_SKIP_UNCHANGED_ALBUMS].name);
+    if (jp_get_pref(PREFS, PREF_SYNC_ORDER, &config.syncOrder, NULL) < 0)
+        jp_logf(L_WARN, "%s: WARNING: Could not read pref '%s' from PREFS[]\n", MYNAME, PREFS[PREF_SYNC_ORDER].name);
+    if (jp_get_pref(PREFS, PREF_DRY_RUN, &config.dryRun, NULL) < 0)
+        jp_logf(L_WARN, "%s: WARNING: Could not read pref '%s' from PREFS[]\n", MYNAME, PREFS[PREF_DRY_RUN].name);
+    if (jp_get_pref(PREFS, PREF_SYNC_TIME_LIMIT, &config.syncTimeLimit, NULL) < 0)
+        jp_logf(L_WARN, "%s: WARNING: Could not read pref '%s' from PREFS[]\n", MYNAME, PREFS[PREF_SYNC_TIME_LIMIT].name);
+    if (jp_get_pref(PREFS, PREF_SYNC_BYTE_LIMIT, &config.syncByteLimit, NULL) < 0)
+        jp_logf(L_WARN, "%s: WARNING: Could not read pref '%s' from PREFS[]\n", MYNAME, PREFS[PREF_SYNC_BYTE_LIMIT].name);
+    if (jp_get_pref(PREFS, PREF_ALBUM_FILTER, NULL, &config.albumFilterRules) < 0)
+        jp_logf(L_WARN, "%s: WARNING: Could not read pref '%s' from PREFS[]\n", MYNAME, PREFS[PREF_ALBUM_FILTER].name);
+    if (jp_get_pref(PREFS, PREF_FILE_FILTER, NULL, &config.fileFilterRules) < 0)
+        jp_logf(L_WARN, "%s: WARNING: Could not read pref '%s' from PREFS[]\n", MYNAME, PREFS[PREF_FILE_FILTER].name);
+    long filterPrint = 0;
+    if (jp_get_pref(PREFS, PREF_FILTER_PRINT, &filterPrint, NULL) < 0)
+        jp_logf(L_WARN, "%s: WARNING: Could not read pref '%s' from PREFS[]\n", MYNAME, PREFS[PREF_FILTER_PRINT].name);
+    if (jp_get_pref(PREFS, PREF_TRACE_DUMP, &config.traceDump, NULL) < 0)
+        jp_logf(L_WARN, "%s: WARNING: Could not read pref '%s' from PREFS[]\n", MYNAME, PREFS[PREF_TRACE_DUMP].name);
+    if (jp_get_pref(PREFS, PREF_ROOT_DIRS, NULL, &config.rootDirRules) < 0)
+        jp_logf(L_WARN, "%s: WARNING: Could not read pref '%s' from PREFS[]\n", MYNAME, PREFS[PREF_ROOT_DIRS].name);
+    if (jp_get_pref(PREFS, PREF_ALBUM_DEPTH, &config.albumDepth, NULL) < 0)
+        jp_logf(L_WARN, "%s: WARNING: Could not read pref '%s' from PREFS[]\n", MYNAME, PREFS[PREF_ALBUM_DEPTH].name);
+    if (jp_get_pref(PREFS, PREF_SKIP_KNOWN_FILES, &config.skipKnownFiles, NULL) < 0)
+        jp_logf(L_WARN, "%s: WARNING: Could not read pref '%s' from PREFS[]\n", MYNAME, PREFS[PREF_SKIP_KNOWN_FILES].name);
+    if (jp_pref_write_rc_file(PREFS_FILE, PREFS, NUM_PREFS) < 0) // To initialize with defaults, if pref file wasn't existent.
+        jp_logf(L_WARN, "%s: WARNING: Could not write PREFS to '%s'\n", MYNAME, PREFS_FILE);
+    if (config.chunkSize && (config.chunkSize < 512 || config.chunkSize > 1048576)) {
+        jp_logf(L_WARN, "%s: WARNING: Pref '%s' out of range, so tuning it automatically\n", MYNAME, PREFS[PREF_CHUNK_SIZE].name);
+        config.chunkSize = 0;
+    }
+    if (config.albumDepth < 0 || config.albumDepth > MAX_ALBUM_DEPTH) {
+        jp_logf(L_WARN, "%s: WARNING: Pref '%s' out of range, so limiting it to %u\n", MYNAME, PREFS[PREF_ALBUM_DEPTH].name, MAX_ALBUM_DEPTH);
+        config.albumDepth = config.albumDepth < 0 ? 0 : MAX_ALBUM_DEPTH;
+    }
+    // Compile the file types and filters, so each directory entry is matched by a few hash lookups.
+    // Parse a copy, as the prefs are written back later.
+    char types[strlen(config.fileTypes) + 1], rule[sizeof(types) + 1];
+    strcpy(types, config.fileTypes);
+    for (char *last; (last = strrchr(types, '.')); *last = 0) {
+        if (filterAdd(&config.fileFilter, RULE_TYPE, strcat(strcpy(rule, "*"), last)) < 0) {
+            engineCleanup();
+            return NULL;
+        }
+    }
+    // Treo 650 has #Thumbnail dir that is not an album
+    if ((!config.synchThumbnailsAlbum && filterAdd(&config.albumFilter, RULE_EXCLUDE, "#Thumbnail") < 0) ||
+            filterCompile(&config.albumFilter, config.albumFilterRules) < 0 || filterCompile(&config.fileFilter, config.fileFilterRules) < 0 ||
+            rootsCompile(&config.roots, config.rootDirRules) < 0) {
+        engineCleanup();
+        return NULL;
+    }
+    // The walked dirs change the album fingerprints too, as they record the subdirs walked.
+    config.filterPrint = strHash(config.fileTypes) * 31 + strHash(config.albumFilterRules) * 7 + strHash(config.fileFilterRules) +
+            !config.synchThumbnailsAlbum + strHash(config.rootDirRules) * 17 + config.albumDepth * 131;
+    config.filterChanged = config.filterPrint != (uint32_t)filterPrint;
+    return &config;
+}
+
+void engineCleanup(void) {
+    deferShutdown();
+    pthread_mutex_lock(&warmLock);
+    warmWait();
+    localFree(&warmIndex);
+    warmState = WARM_NONE;
+    pthread_mutex_unlock(&warmLock);
+    filterFree(&config.albumFilter);
+    filterFree(&config.fileFilter);
+    rootsFree(&config.roots);
+    manifestFree();
+    jp_free_prefs(PREFS, NUM_PREFS);
+    memset(&config, 0, sizeof(config));
+}
+
+/*
+ * Create a session to sync the device connected by sd with config, which must stay valid meanwhile.
+ * Sessions of several devices may sync at once, each by its own thread.
+ * Returns NULL if out of memory.
+ */
+syncSession *sessionNew(int sd, const syncConfig *config) {
+    syncSession *session;
+    int result;
+
+    if (!(session = calloc(1, sizeof(*session)))) {
+        jp_logf(L_FATAL, "%s: ERROR: Out of memory\n", MYNAME);
+        return NULL;
+    }
+    session->sd = sd;
+    session->config = config;
+    session->result = -1;
+    if ((result = !(session->palmBuf = pi_buffer_new(65536)) || !(session->pcBuf = pi_buffer_new(65536))))
+        jp_logf(L_FATAL, "%s: ERROR: Out of memory\n", MYNAME);
+    for (int i = 0; !result && i < PIPE_BUFFERS; i++) {
+        if ((result = !(session->pipeBufs[i] = pi_buffer_new(MAX(config->chunkSize, DEFAULT_CHUNK_SIZE)))))
+            jp_logf(L_FATAL, "%s: ERROR: Out of memory\n", MYNAME);
+    }
+    if (result) {
+        sessionFree(session);
+        return NULL;
+    }
+    return session;
+}
+
+void sessionFree(syncSession *session) {
+    if (!session)  return;
+    pi_buffer_free(session->palmBuf);
+    pi_buffer_free(session->pcBuf);
+    for (int i = 0; i < PIPE_BUFFERS; i++)  pi_buffer_free(session->pipeBufs[i]);
+    deferWait(session);
+    for (deferredJob *job; (job = session->unsynced);) {
+        session->unsynced = job->next;
+        releasePath(&job->claim);
+        free(job);
+    }
+    for (deferredJob *job; (job = session->deferredDone);) {
+        session->deferredDone = job->next;
+        free(job);
+    }
+    for (albumPrint *print; (print = session->donePrints);) {
+        session->donePrints = print->next;
+        free(print);
+    }
+    statsFree(&session->stats);
+    dirIndexFree(&session->ensuredDirs);
+    free(session);
+}
+
+/*
+ * Backup the media of the device of session.
+ */
+int sessionSync(syncSession *session) {
+    const syncConfig *config = session->config;
+    int volRefs[MAX_VOLUMES];
+    int volumes = MAX_VOLUMES;
+
+    jp_logf(L_GUI, "%s: Start syncing ...", MYNAME);
+    jp_logf(L_DEBUG, "\n");
+    statsBegin(&session->stats);
+    session->result = -1;
+    session->volumeInfoCount = 0;
+    dirIndexFree(&session->ensuredDirs);
+
+    // Get list of the volumes on the pilot.
+    if (volumeEnumerateIncludeHidden(session, &volumes, volRefs) < 0) {
+        jp_logf(L_FATAL, "\n%s: ERROR: Could not find any VFS volumes; no media fetched\n", MYNAME);
+        return EXIT_FAILURE;
+    }
+    deviceIdentify(session);
+    // Use $JPILOT_HOME/.jpilot/ or current directory for PCDIR.
+    if (jp_get_home_file_name(PCDIR, session->pcPath, sizeof(session->pcPath)) < 0) {
+        jp_logf(L_WARN, "\n%s: WARNING: Could not get $JPILOT_HOME path, so using './%s'\n", MYNAME, PCDIR);
+        strcpy(session->pcPath, PCDIR);
+    } else {
+        jp_logf(L_GUI, " with '%s'\n", session->pcPath);
+    }
+    // Check if there are any file types loaded.
+    if (!config->fileFilter.rules[RULE_TYPE]) {
+        jp_logf(L_FATAL, "%s: ERROR: Could not find any file types from '%s'; no media fetched\n", MYNAME, PREFS_FILE);
+        return EXIT_FAILURE;
+    }
+
+    // Use the manifest and Media folder loaded during the handshake, or load the manifest now.
+    sessionsRunning(1);
+    pthread_mutex_lock(&warmLock);
+    warmWait();
+    // Copies deleted since the scan would be taken as present, so don't trust an old scan, i.e. if it was
+    // finished long before the device came. It is dropped, when the last session using it ends.
+    session->local = warmState == WARM_READY && monotonicSecs() - warmDone <= WARM_MAX_AGE ? &warmIndex : NULL;
+    if (warmState == WARM_READY && !session->local)
+        jp_logf(L_DEBUG, "%s: Scan of '%s' is older than %.0f s, so not using it\n", MYNAME, PCDIR, WARM_MAX_AGE);
+    pthread_mutex_unlock(&warmLock);
+    // Load the list of already fetched files, so they need not to be opened on the Palm again.
+    if (manifestLoad() < 0) {
+        jp_logf(L_WARN, "%s: WARNING: Could not load manifest '%s', so check all files on the Palm\n", MYNAME, MANIFEST_FILE);
+    }
+
+    // Scan all the volumes for media, then backup them in the order of syncOrder.
+    syncPlan plan = {0};
+    if (config->syncTimeLimit > 0)  plan.deadline = session->stats.start + config->syncTimeLimit;
+    PI_ERR volResults[MAX_VOLUMES];
+    for (int i=0; i<volumes; i++) {
+        volResults[i] = planVolume(session, &plan, volRefs[i]);
+    }
+    planSort(&plan);
+    jp_logf(L_GUI, "%s: Planned %u files with %lld bytes to check ...\n", MYNAME, plan.count, plan.bytes);
+    if (config->dryRun) {
+        planReport(&plan);
+    } else {
+        planExecute(session, &plan);
+    }
+    for (plannedAlbum *album = plan.albums; album; album = album->next) {
+        for (int i=0; i<volumes; i++) {
+            if (volRefs[i] == album->volRef)  volResults[i] = MIN(volResults[i], album->result);
+        }
+    }
+    planFree(&plan);
+    session->local = NULL;
+    sessionsRunning(-1);
+
+    PI_ERR result = EXIT_FAILURE;
+    for (int i=0; i<volumes; i++) {
+        PI_ERR volResult;
+        if ((volResult = volResults[i]) < 0) {
+            jp_logf(L_WARN, "%s: WARNING: Could not find any media on volume %d; no media fetched\n", MYNAME, volRefs[i]);
+            jp_logf(L_DEBUG, "%s: Result from volume %d: %d\n", MYNAME, volRefs[i], volResult);
+            continue;
+        }
+        result = EXIT_SUCCESS;
+    }
+    jp_logf(L_DEBUG, "%s: Sync done -> result=%d\n", MYNAME, result);
+    return session->result = result;
+}
+
+/*
+ * Wait for the local work deferred by the sync of session, then save the manifest, the prefs and
+ * the statistics. To be called after the device is released.
+ */
+int sessionFinish(syncSession *session) {
+    deferAlbumSync(session, NULL);
+    deferWait(session);
+    for (albumPrint *print; (print = session->donePrints);) {
+        session->donePrints = print->next;
+        albumPrintRecord(print);
+        free(print);
+    }
+    pthread_mutex_lock(&deferLock);
+    for (deferredJob *job; (job = session->deferredDone);) {
+        session->deferredDone = job->next;
+        statsPhase(&session->stats, PHASE_SET_DATE, job->secs, 0);
+        if (job->linked && job->album)  job->album->linked++;
+        if (job->failed) {
+            // The album was fingerprinted as complete meanwhile, so let it be listed again.
+            char albumKey[strlen(job->key) + 1];
+            strcpy(albumKey, job->key)[strrchr(job->key, '/') - job->key + 1] = '\0';
+            albumPrintInvalidate(albumKey);
+            if (job->album)  job->album->failed++;
+            session->result = -1;
+        }
+        free(job);
+    }
+    statsPhase(&session->stats, PHASE_WRITE, session->syncSecs, 0);
+    pthread_mutex_unlock(&deferLock);
+    if (manifestSave() < 0) {
+        jp_logf(L_WARN, "%s: WARNING: Could not save manifest '%s'\n", MYNAME, MANIFEST_FILE);
+    }
+    pthread_mutex_lock(&prefsLock);
+    // Only now the album fingerprints are recorded for the changed filters.
+    if (session->config->filterChanged && session->result >= 0) {
+        jp_set_pref(PREFS, PREF_FILTER_PRINT, session->config->filterPrint, NULL);
+        prefsDirty = 1;
+    }
+    if (prefsDirty && jp_pref_write_rc_file(PREFS_FILE, PREFS, NUM_PREFS) < 0) {
+        jp_logf(L_WARN, "%s: WARNING: Could not write PREFS to '%s'\n", MYNAME, PREFS_FILE);
+    }
+    prefsDirty = 0;
+    pthread_mutex_unlock(&prefsLock);
+    if ((session->result != EXIT_SUCCESS || session->config->traceDump) && engineTraceDump(TRACE_FILE) < 0) {
+        jp_logf(L_WARN, "%s: WARNING: Could not write the trace to '%s'\n", MYNAME, TRACE_FILE);
+    }
+    if (session->result < 0)  return EXIT_FAILURE;
+    if (session->config->statsReport && statsWrite(&session->stats, session->result) < 0) {
+        jp_logf(L_WARN, "%s: WARNING: Could not write statistics to '%s'\n", MYNAME, STATS_FILE);
+    }
+    return session->result;
+}
+
+void *mallocLog(size_t size) {
+    void *p;
+    if (!(p = malloc(size)))
+        jp_logf(L_FATAL, "%s: ERROR: Out of memory\n", MYNAME);
+    return p;
+}
+
+int createDir(syncSession *session, char *path, const char *dir) {
+    if (dir == session->pcPath)  strcpy(path, session->pcPath);
+    else  strcat(strcat(path, "/"), dir);
+    if (dirIndexContains(&session->ensuredDirs, path))  return 0; // already created or found in this sync
+    const localEntry *e;
+    if (session->local && (e = localLookup(session->local, path)) && S_ISDIR(e->mode)) {
+        dirIndexAdd(&session->ensuredDirs, path);
+        return 0;
+    }
+    int result;
+    if ((result = mkdir(path, 0777))) {
+        if (errno != EEXIST) {
+            jp_logf(L_FATAL, "%s:     ERROR: Could not create directory %s\n", MYNAME, path);
+            return result;
+        }
+    }
+    dirIndexAdd(&session->ensuredDirs, path);
+    return 0;
+}
+
+static double monotonicSecs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * The trace records the events of the loops over directory entries and files, which are too many for
+ * formatting them by jp_logf() on each sync. Each thread writes fixed size events to its own ring of the
+ * last TRACE_EVENTS, without locking, as only the thread itself writes to it. The events are formatted by
+ * TRACE_FORMATS only, when the rings are dumped by engineTraceDump(), i.e. after a failed sync. The ring of a
+ * finished thread is kept, until a new thread takes it over.
+ */
+static const char *TRACE_FORMATS[TRACE_IDS] = {
+    "Enumerate '%s', itr=%lx, dirItems=%ld",
+    "Enumerate '%s' could not continue at itr=%lx, so restart",
+    "Enumerate '%s' OK: result=%ld, itr=%lx, dirItems=%ld",
+    "Queued dir '%s' at level %ld",
+    "Dir '%s' does not match the root pattern",
+    "Album '%s' filtered out",
+    "Album '%s' unchanged, not enumerating it",
+    "Album '%s' planned -> result=%ld",
+    "Found file '%s' attribute %lx",
+    "File '%s' already fetched, not opening it",
+    "File '%s' filtered out by its size %ld",
+    "File '%s' already exists, not copying it",
+    "File '%s' already exists, but has different date",
+    "File '%s' size / copy result: %ld, statErr=%ld",
+    "Linked '%s' to identical content"
+};
+#define TRACE_EVENTS 4096 // per thread, a power of 2
+#define TRACE_TEXT 40
+typedef struct traceEvent {
+    struct timespec time;
+    unsigned thread;
+    int id;
+    long args[3];
+    char text[TRACE_TEXT]; // the tail of a longer name
+} traceEvent;
+typedef struct traceRing {
+    struct traceRing *next;
+    unsigned thread; // number for the dump
+    int inUse;
+    unsigned long count; // of events written, the last TRACE_EVENTS kept
+    traceEvent events[TRACE_EVENTS];
+} traceRing;
+static traceRing *traceRings;
+static unsigned traceThreads;
+static __thread traceRing *traceLocal;
+static pthread_key_t traceKey;
+static pthread_once_t traceOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER; // guards the list of rings and their inUse
+
+static void traceRelease(void *ring) {
+    pthread_mutex_lock(&traceLock);
+    ((traceRing *)ring)->inUse = 0;
+    pthread_mutex_unlock(&traceLock);
+}
+
+static void traceKeyCreate(void) {
+    pthread_key_create(&traceKey, traceRelease);
+}
+
+/*
+ * Give the calling thread a ring, which is released when it ends.
+ */
+static traceRing *traceAttach(void) {
+    traceRing *ring;
+
+    pthread_once(&traceOnce, traceKeyCreate);
+    pthread_mutex_lock(&traceLock);
+    for (ring = traceRings; ring && ring->inUse; ring = ring->next);
+    if (!ring && (ring = calloc(1, sizeof(*ring)))) {
+        ring->thread = ++traceThreads;
+        ring->next = traceRings;
+        traceRings = ring;
+    }
+    if (ring) {
+        ring->inUse = 1;
+        pthread_setspecific(traceKey, ring);
+    }
+    pthread_mutex_unlock(&traceLock);
+    return traceLocal = ring;
+}
+
+/*
+ * Record event id with text and up to 3 numbers, as given by TRACE_FORMATS[id].
+ */
+static void trace(int id, const char *text, long a, long b, long c) {
+    traceRing *ring = traceLocal;
+    size_t len = strlen(text);
+
+    if (!ring && !(ring = traceAttach()))  return;
+    traceEvent *e = &ring->events[ring->count & (TRACE_EVENTS - 1)];
+    clock_gettime(CLOCK_MONOTONIC, &e->time);
+    e->thread = ring->thread;
+    e->id = id;
+    e->args[0] = a;
+    e->args[1] = b;
+    e->args[2] = c;
+    if (len >= TRACE_TEXT) {
+        text += len - (TRACE_TEXT - 1);
+        len = TRACE_TEXT - 1;
+    }
+    memcpy(e->text, text, len + 1);
+    __atomic_store_n(&ring->count, ring->count + 1, __ATOMIC_RELEASE);
+}
+
+static int traceCompare(const void *a, const void *b) {
+    const struct timespec *s = &(*(traceEvent * const *)a)->time, *t = &(*(traceEvent * const *)b)->time;
+    return s->tv_sec != t->tv_sec ? (s->tv_sec > t->tv_sec) - (s->tv_sec < t->tv_sec) : (s->tv_nsec > t->tv_nsec) - (s->tv_nsec < t->tv_nsec);
+}
+
+int engineTraceDump(const char *file) {
+    unsigned n = 0, rings = 0;
+    FILE *stream;
+    int result = 0;
+
+    if (!(stream = file ? jp_open_home_file((char *)file, "w") : stderr))  return -1;
+    pthread_mutex_lock(&traceLock);
+    for (traceRing *ring = traceRings; ring; ring = ring->next)  rings++;
+    // Events written by running threads meanwhile may be garbled, but the older ones are left intact.
+    traceEvent **events = malloc(rings * TRACE_EVENTS * sizeof(*events) + 1);
+    for (traceRing *ring = traceRings; events && ring; ring = ring->next) {
+        unsigned long count = __atomic_load_n(&ring->count, __ATOMIC_ACQUIRE);
+        for (unsigned long i = count > TRACE_EVENTS ? count - TRACE_EVENTS : 0; i < count; i++)
+            events[n++] = &ring->events[i & (TRACE_EVENTS - 1)];
+    }
+    pthread_mutex_unlock(&traceLock);
+    if (events) {
+        qsort(events, n, sizeof(*events), traceCompare);
+        for (unsigned i = 0; i < n; i++) {
+            traceEvent *e = events[i];
+            fprintf(stream, "%ld.%06ld #%u ", (long)e->time.tv_sec, e->time.tv_nsec / 1000, e->thread);
+            if (e->id >= 0 && e->id < TRACE_IDS)  fprintf(stream, TRACE_FORMATS[e->id], e->text, e->args[0], e->args[1], e->args[2]);
+            fputc('\n', stream);
+        }
+    } else {
+        jp_logf(L_FATAL, "%s: ERROR: Out of memory\n", MYNAME);
+        result = -1;
+    }
+    free(events);
+    if (ferror(stream))  result = -1;
+    if (file ? fclose(stream) : fflush(stream))  result = -1;
+    return result;
+}
+
+/*
+ * Each sync records per phase how often it was entered, its time and bytes, and per DLP call the count,
+ * errors, time and a histogram of latencies. Phases may overlap: the DLP reads of a compare are part of
+ * the compare phase, and writing is done in parallel to reading by the writer thread of fileCopy().
+ * At the end of the sync, the statistics are written to STATS_FILE as JSON, together with the files
+ * and bytes per volume and album, and a summary line is appended to STATS_HISTORY_FILE as CSV.
+ */
+void statsFree(syncStats *stats) {
+    for (albumStats *a; (a = stats->albums);) {
+        stats->albums = a->next;
+        free(a);
+    }
+    memset(stats, 0, sizeof(*stats));
+}
+
+void statsBegin(syncStats *stats) {
+    statsFree(stats);
+    stats->lastAlbum = &stats->albums;
+    stats->date = time(NULL);
+    stats->start = monotonicSecs();
+}
+
+static void statsPhase(syncStats *stats, int phase, double secs, unsigned long long bytes) {
+    if (phase == PHASE_NONE)  return;
+    stats->phases[phase].count++;
+    stats->phases[phase].secs += secs;
+    stats->phases[phase].bytes += bytes;
+}
+
+/*
+ * Record a DLP call of session, which was started at its dlpStart, see DLP().
+ * Returns result.
+ */
+static int statsDlp(syncSession *session, int call, int phase, int result) {
+    syncStats *stats = &session->stats;
+    double secs = monotonicSecs() - session->dlpStart;
+    int bucket = 0;
+
+    for (double usecs = secs * 1e6; usecs >= 1 && bucket < LATENCY_BUCKETS - 1; usecs /= 2)  bucket++;
+    stats->dlp[call].count++;
+    stats->dlp[call].errors += result < 0;
+    stats->dlp[call].secs += secs;
+    stats->dlp[call].latency[bucket]++;
+    statsPhase(stats, phase, secs, call == DLP_FILE_READ && result > 0 ? result : 0);
+    return result;
+}
+
+/*
+ * Evaluate the dlp_*() call expr, recording it in the statistics of session.
+ */
+#define DLP(session, call, phase, expr) ((session)->dlpStart = monotonicSecs(), statsDlp(session, call, phase, (expr)))
+
+/*
+ * Get the device of session by its user ID, or its user name if it was never synced, so the files of
+ * several devices with the same names are told apart in the shared manifest.
+ */
+static void deviceIdentify(syncSession *session) {
+    struct PilotUser user;
+
+    session->device[0] = 0;
+    if (DLP(session, DLP_READ_USER_INFO, PHASE_NONE, dlp_ReadUserInfo(session->sd, &user)) < 0) {
+        jp_logf(L_WARN, "\n%s: WARNING: Could not read the user info, so the manifest can't tell this device apart\n", MYNAME);
+    } else if (user.userID) {
+        snprintf(session->device, sizeof(session->device), "%lu", (unsigned long)user.userID);
+    } else {
+        snprintf(session->device, sizeof(session->device), "%.*s", (int)sizeof(session->device) - 1, user.username);
+    }
+}
+
+/*
+ * Continue recording the files of album a, until statsAlbumEnd().
+ */
+static void statsAlbumResume(syncStats *stats, albumStats *a) {
+    stats->album = a;
+    stats->albumStart = monotonicSecs();
+}
+
+/*
+ * Start recording the files of an album, until statsAlbumEnd().
+ */
+static albumStats *statsAlbumBegin(syncStats *stats, unsigned volRef, const char *card, const char *name) {
+    albumStats *a;
+
+    if (!stats->lastAlbum || !(a = calloc(1, sizeof(*a) + strlen(name) + 1)))  return NULL; // just don't record
+    a->volRef = volRef;
+    strcpy(a->card, card);
+    strcpy(a->name, name);
+    *stats->lastAlbum = a;
+    stats->lastAlbum = &a->next;
+    statsAlbumResume(stats, a);
+    return a;
+}
+
+static void statsAlbumEnd(syncStats *stats) {
+    if (stats->album)  stats->album->secs += monotonicSecs() - stats->albumStart;
+    stats->album = NULL;
+}
+
+static void jsonString(FILE *stream, const char *str) {
+    fputc('"', stream);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')  fprintf(stream, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20)  fprintf(stream, "\\u%04x", *str);
+        else  fputc(*str, stream);
+    }
+    fputc('"', stream);
+}
+
+static void jsonAlbumTotals(FILE *stream, const albumStats *a) {
+    fprintf(stream, "\"files\": %lu, \"fetched\": %lu, \"linked\": %lu, \"failed\": %lu, \"bytes\": %llu, \"seconds\": %.6f",
+            a->files, a->fetched, a->linked, a->failed, a->bytes, a->secs);
+}
+
+/*
+ * Write the statistics of the finished sync, see statsBegin(). Of syncs finishing at the same time, the
+ * last one is kept in STATS_FILE, but each is appended to STATS_HISTORY_FILE.
+ * Returns 0, or -1 on error.
+ */
+int statsWrite(syncStats *stats, int syncResult) {
+    char date[32];
+    struct tm tm;
+    FILE *stream;
+    albumStats total = {0};
+    unsigned long dlpCalls = 0;
+    int result = 0;
+
+    stats->secs = monotonicSecs() - stats->start;
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime_r(&stats->date, &tm));
+    for (albumStats *a = stats->albums; a; a = a->next) {
+        total.files += a->files;
+        total.fetched += a->fetched;
+        total.linked += a->linked;
+        total.failed += a->failed;
+        total.bytes += a->bytes;
+    }
+    for (int c = 0; c < DLP_CALLS; c++)  dlpCalls += stats->dlp[c].count;
+    double rate = total.bytes / (stats->secs > 0 ? stats->secs : 1e-9);
+    jp_logf(L_GUI, "%s: Fetched %lu files, %llu bytes in %.1f s (%.0f bytes/s)\n", MYNAME, total.fetched, total.bytes, stats->secs, rate);
+
+    pthread_mutex_lock(&reportLock);
+    if (!(stream = jp_open_home_file((char *)STATS_FILE, "w"))) {
+        pthread_mutex_unlock(&reportLock);
+        return -1;
+    }
+    fprintf(stream, "{\n  \"version\": \"%s\",\n  \"date\": \"%s\",\n  \"result\": %d,\n  \"bytesPerSecond\": %.0f,\n  ",
+            VERSION, date, syncResult, rate);
+    fprintf(stream, "\"left\": {\"files\": %lu, \"bytes\": %llu},\n  ", stats->leftFiles, stats->leftBytes);
+    total.secs = stats->secs;
+    jsonAlbumTotals(stream, &total);
+    fprintf(stream, ",\n  \"phases\": {");
+    for (int p = 0; p < PHASES; p++) {
+        fprintf(stream, "%s\n    \"%s\": {\"count\": %lu, \"seconds\": %.6f, \"bytes\": %llu}", p ? "," : "",
+                PHASE_NAMES[p], stats->phases[p].count, stats->phases[p].secs, stats->phases[p].bytes);
+    }
+    fprintf(stream, "\n  },\n  \"latencyBucketsUsec\": \"bucket i counts latencies < 2^i usec\",\n  \"dlpCalls\": {");
+    for (int c = 0; c < DLP_CALLS; c++) {
+        fprintf(stream, "%s\n    \"%s\": {\"count\": %lu, \"errors\": %lu, \"seconds\": %.6f, \"latency\": [", c ? "," : "",
+                DLP_NAMES[c], stats->dlp[c].count, stats->dlp[c].errors, stats->dlp[c].secs);
+        for (int b = 0; b < LATENCY_BUCKETS; b++)  fprintf(stream, "%s%lu", b ? ", " : "", stats->dlp[c].latency[b]);
+        fprintf(stream, "]}");
+    }
+    fprintf(stream, "\n  },\n  \"volumes\": [");
+    int volumes = 0;
+    for (albumStats *v = stats->albums; v; v = v->next) {
+        albumStats *a, volume = {0};
+        for (a = stats->albums; a != v && a->volRef != v->volRef; a = a->next);
+        if (a != v)  continue; // volume already written
+        for (a = v; a; a = a->next) {
+            if (a->volRef != v->volRef)  continue;
+            volume.files += a->files;
+            volume.fetched += a->fetched;
+            volume.linked += a->linked;
+            volume.failed += a->failed;
+            volume.bytes += a->bytes;
+            volume.secs += a->secs;
+        }
+        fprintf(stream, "%s\n    {\"volRef\": %u, \"card\": ", volumes++ ? "," : "", v->volRef);
+        jsonString(stream, v->card);
+        fprintf(stream, ", ");
+        jsonAlbumTotals(stream, &volume);
+        fprintf(stream, ", \"albums\": [");
+        int albums = 0;
+        for (a = v; a; a = a->next) {
+            if (a->volRef != v->volRef)  continue;
+            fprintf(stream, "%s\n      {\"album\": ", albums++ ? "," : "");
+            jsonString(stream, a->name);
+            fprintf(stream, ", ");
+            jsonAlbumTotals(stream, a);
+            fprintf(stream, "}");
+        }
+        fprintf(stream, "\n    ]}");
+    }
+    fprintf(stream, "\n  ]\n}\n");
+    if (ferror(stream))  result = -1;
+    if (fclose(stream))  result = -1;
+
+    // One line per sync, to follow the throughput across devices and releases.
+    if (!(stream = jp_open_home_file((char *)STATS_HISTORY_FILE, "a"))) {
+        pthread_mutex_unlock(&reportLock);
+        return -1;
+    }
+    if (!ftell(stream)) {
+        fprintf(stream, "date,version,result,seconds,bytesPerSecond,files,fetched,linked,failed,bytes,dlpCalls");
+        for (int p = 0; p < PHASES; p++)  fprintf(stream, ",%sSeconds", PHASE_NAMES[p]);
+        fprintf(stream, "\n");
+    }
+    fprintf(stream, "%s,%s,%d,%.3f,%.0f,%lu,%lu,%lu,%lu,%llu,%lu", date, VERSION, syncResult, stats->secs, rate,
+            total.files, total.fetched, total.linked, total.failed, total.bytes, dlpCalls);
+    for (int p = 0; p < PHASES; p++)  fprintf(stream, ",%.3f", stats->phases[p].secs);
+    fprintf(stream, "\n");
+    if (fclose(stream))  result = -1;
+    pthread_mutex_unlock(&reportLock);
+    return result;
+}
+
+/*
+ * The manifest remembers each file, which was fetched or found to be already backuped before, keyed by
+ * "device|card:/root/album/file" together with its size, modified date and backup path relative to PCDIR.
+ * The device is its user ID or name, so devices with files of the same names share the manifest. Files of
+ * devices without both are keyed by "card:/root/album/file".
+ * So such a file needs not to be opened on the Palm again, as long as its backup exists on the PC.
+ * The manifest file starts with MANIFEST_MAGIC, followed by records of the form:
+ *     uint8 type, uint16 keyLen, uint16 dataLen, char key[keyLen], uint8 data[dataLen]
+ * Data of a MANIFEST_FILE_ENTRY is: uint32 size, int64 date, char dst[]. All numbers are little endian.
+ * A MANIFEST_CONTENT_DIGEST following it, with the same key, holds: uint64 XXH64 of the content.
+ * Records of unknown type and unknown trailing data are skipped, so the format can be extended.
+ * Besides by key, the entries are indexed by size in contentIndex, to find identical content.
+ * The manifest is shared by all sessions, so it is guarded by manifestLock, and entries are handed out
+ * only as copies, as another session may replace them meanwhile.
+ */
+static uint32_t strHash(const char *str) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    while (*str)  hash = (hash ^ (unsigned char)*str++) * 16777619u;
+    return hash;
+}
+
+static uint64_t getLE(const unsigned char *p, int n) {
+    uint64_t v = 0;
+    while (n--)  v = v << 8 | p[n];
+    return v;
+}
+
+static unsigned char *putLE(unsigned char *p, uint64_t v, int n) {
+    for (; n--; v >>= 8)  *p++ = (unsigned char)v;
+    return p;
+}
+
+/*
+ * Streaming XXH64 with seed 0, see <https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md>.
+ */
+static const uint64_t XXH_P1 = 11400714785074694791ull, XXH_P2 = 14029467366897019727ull,
+        XXH_P3 = 1609587929392839161ull, XXH_P4 = 9650029242287828579ull, XXH_P5 = 2870177450012600261ull;
+
+static uint64_t xxhRotl(uint64_t x, int r) {
+    return x << r | x >> (64 - r);
+}
+
+static uint64_t xxhRead(const unsigned char *p, int n) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t v = 0;
+    memcpy(&v, p, n);
+    return v;
+#else
+    return getLE(p, n);
+#endif
+}
+
+static uint64_t xxhRound(uint64_t acc, uint64_t input) {
+    return xxhRotl(acc + input * XXH_P2, 31) * XXH_P1;
+}
+
+void xxh64Init(xxh64State *state) {
+    memset(state, 0, sizeof(*state));
+    state->v[0] = XXH_P1 + XXH_P2;
+    state->v[1] = XXH_P2;
+    state->v[3] = -XXH_P1;
+}
+
+void xxh64Update(xxh64State *state, const void *data, size_t len) {
+    const unsigned char *p = data, *end = p + len;
+
+    state->total += len;
+    if (state->memSize + len < sizeof(state->mem)) {
+        memcpy(state->mem + state->memSize, p, len);
+        state->memSize += len;
+        return;
+    }
+    if (state->memSize) {
+        memcpy(state->mem + state->memSize, p, sizeof(state->mem) - state->memSize);
+        p += sizeof(state->mem) - state->memSize;
+        for (int i = 0; i < 4; i++)  state->v[i] = xxhRound(state->v[i], xxhRead(state->mem + 8 * i, 8));
+        state->memSize = 0;
+    }
+    for (; end - p >= 32; p += 32) {
+        for (int i = 0; i < 4; i++)  state->v[i] = xxhRound(state->v[i], xxhRead(p + 8 * i, 8));
+    }
+    memcpy(state->mem, p, end - p);
+    state->memSize = end - p;
+}
+
+uint64_t xxh64Digest(const xxh64State *state) {
+    const unsigned char *p = state->mem, *end = p + state->memSize;
+    uint64_t h;
+
+    if (state->total >= 32) {
+        h = xxhRotl(state->v[0], 1) + xxhRotl(state->v[1], 7) + xxhRotl(state->v[2], 12) + xxhRotl(state->v[3], 18);
+        for (int i = 0; i < 4; i++)  h = (h ^ xxhRound(0, state->v[i])) * XXH_P1 + XXH_P4;
+    } else {
+        h = state->v[2] + XXH_P5;
+    }
+    h += state->total;
+    for (; end - p >= 8; p += 8)  h = xxhRotl(h ^ xxhRound(0, xxhRead(p, 8)), 27) * XXH_P1 + XXH_P4;
+    if (end - p >= 4) {
+        h = xxhRotl(h ^ xxhRead(p, 4) * XXH_P1, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    for (; p < end; p++)  h = xxhRotl(h ^ *p * XXH_P5, 11) * XXH_P1;
+    h = (h ^ h >> 33) * XXH_P2;
+    h = (h ^ h >> 29) * XXH_P3;
+    return h ^ h >> 32;
+}
+
+char *manifestKey(char *key, size_t len, const char *device, const char *card, const char *srcDir, const char *file) {
+    snprintf(key, len, "%s%s%s:%s/%s", device, *device ? "|" : "", card, srcDir, file);
+    return key;
+}
+
+/*
+ * The functions not locking manifestLock themselves must be called with it held.
+ */
+static manifestEntry *manifestLookup(const char *key) {
+    if (!manifest)  return NULL;
+    uint32_t hash = strHash(key);
+    for (manifestEntry *e = manifest[hash & (manifestBuckets - 1)]; e; e = e->next) {
+        if (e->hash == hash && !strcmp(e->key, key))  return e;
+    }
+    return NULL;
+}
+
+static int manifestCopy(const manifestEntry *e, manifestInfo *info) {
+    if (strlen(e->dst) >= sizeof(info->dst))  return 0;
+    info->size = e->size;
+    info->date = e->date;
+    info->digest = e->digest;
+    info->hasDigest = e->hasDigest;
+    strcpy(info->dst, e->dst);
+    return 1;
+}
+
+/*
+ * Copy the entry for key to info.
+ * Returns 1, or 0 if there is none.
+ */
+int manifestGet(const char *key, manifestInfo *info) {
+    manifestEntry *e;
+    int found;
+
+    pthread_mutex_lock(&manifestLock);
+    found = (e = manifestLookup(key)) && manifestCopy(e, info);
+    pthread_mutex_unlock(&manifestLock);
+    return found;
+}
+
+static unsigned sizeBucket(uint32_t size, unsigned buckets) {
+    return (size * 2654435761u >> 8) & (buckets - 1);
+}
+
+static int manifestInit(unsigned buckets) {
+    if (!(manifest = calloc(buckets, sizeof(*manifest))) || !(contentIndex = calloc(buckets, sizeof(*contentIndex)))) {
+        jp_logf(L_FATAL, "%s: ERROR: Out of memory\n", MYNAME);
+        free(manifest);
+        manifest = NULL;
+        return -1;
+    }
+    manifestBuckets = buckets;
+    manifestCount = 0;
+    manifestDirty = 0;
+    return 0;
+}
+
+static void manifestGrow(void) {
+    manifestEntry **grown, **grownContent;
+    if (!(grown = calloc(manifestBuckets * 2, sizeof(*grown))))
+        return; // keep on with longer chains
+    if (!(grownContent = calloc(manifestBuckets * 2, sizeof(*grownContent)))) {
+        free(grown);
+        return;
+    }
+    for (unsigned i = 0; i < manifestBuckets; i++) {
+        for (manifestEntry *e, *next = manifest[i]; (e = next);) {
+            next = e->next;
+            e->next = grown[e->hash & (manifestBuckets * 2 - 1)];
+            grown[e->hash & (manifestBuckets * 2 - 1)] = e;
+            e->sameSize = grownContent[sizeBucket(e->size, manifestBuckets * 2)];
+            grownContent[sizeBucket(e->size, manifestBuckets * 2)] = e;
+        }
+    }
+    free(manifest);
+    free(contentIndex);
+    manifest = grown;
+    contentIndex = grownContent;
+    manifestBuckets *= 2;
+}
+
+/*
+ * Insert or replace the entry for key.
+ */
+static manifestEntry *manifestPut(const char *key, uint32_t size, time_t date, const char *dst) {
+    manifestEntry *e, **link;
+    uint32_t hash = strHash(key);
+
+    if (!manifest && manifestInit(1024) < 0)  return NULL;
+    for (link = &manifest[hash & (manifestBuckets - 1)]; (e = *link); link = &e->next) {
+        if (e->hash == hash && !strcmp(e->key, key))  break;
+    }
+    if (e && e->size == size && e->date == date && !strcmp(e->dst, dst))  return e; // nothing changed
+    manifestEntry *new;
+    if (!(new = mallocLog(sizeof(*new) + strlen(key) + strlen(dst) + 2)))  return NULL;
+    new->hash = hash;
+    new->size = size;
+    new->date = date;
+    new->hasDigest = e && e->hasDigest && e->size == size && e->date == date; // content unchanged
+    new->digest = new->hasDigest ? e->digest : 0;
+    new->dst = strcpy(new->key, key) + strlen(key) + 1;
+    strcpy(new->dst, dst);
+    if (e) {
+        manifestEntry **same;
+        for (same = &contentIndex[sizeBucket(e->size, manifestBuckets)]; *same != e; same = &(*same)->sameSize);
+        *same = e->sameSize;
+        new->next = e->next;
+        free(e);
+    } else {
+        new->next = NULL;
+        manifestCount++;
+    }
+    *link = new;
+    new->sameSize = contentIndex[sizeBucket(size, manifestBuckets)];
+    contentIndex[sizeBucket(size, manifestBuckets)] = new;
+    manifestDirty = 1;
+    if (manifestCount > manifestBuckets)  manifestGrow();
+    return new;
+}
+
+static void manifestSetDigest(manifestEntry *e, uint64_t digest) {
+    if (!e || (e->hasDigest && e->digest == digest))  return;
+    e->digest = digest;
+    e->hasDigest = 1;
+    manifestDirty = 1;
+}
+
+/*
+ * Insert or replace the entry for key, together with the digest of its content, if given.
+ * Returns 0, or -1 if out of memory.
+ */
+int manifestUpdate(const char *key, uint32_t size, time_t date, const char *dst, const uint64_t *digest) {
+    manifestEntry *e;
+
+    pthread_mutex_lock(&manifestLock);
+    if ((e = manifestPut(key, size, date, dst)) && digest)  manifestSetDigest(e, *digest);
+    pthread_mutex_unlock(&manifestLock);
+    return e ? 0 : -1;
+}
+
+/*
+ * Find an entry other than for key, whose content is identical to a file of size by its digest, and whose
+ * backup below pcPath still exists, and copy it to found. The backup is probed without holding manifestLock,
+ * so other sessions aren't blocked by the disk. *skip counts the entries tried before, so a search can be
+ * continued by calling again.
+ * Returns 1, or 0 if there is no more.
+ */
+int contentFind(uint32_t size, const uint64_t *digest, const char *key, const char *pcPath, unsigned *skip, manifestInfo *found) {
+    struct stat fstat;
+
+    for (;;) {
+        unsigned seen = 0;
+        int hit = 0;
+        pthread_mutex_lock(&manifestLock);
+        for (manifestEntry *e = manifest ? contentIndex[sizeBucket(size, manifestBuckets)] : NULL; e && !hit; e = e->sameSize) {
+            if (e->size != size || !strcmp(e->key, key) || !e->hasDigest || e->digest != *digest || seen++ < *skip)  continue;
+            (*skip)++;
+            hit = manifestCopy(e, found);
+        }
+        pthread_mutex_unlock(&manifestLock);
+        if (!hit)  return 0;
+        char path[strlen(pcPath) + strlen(found->dst) + 2];
+        if (!stat(strcat(strcat(strcpy(path, pcPath), "/"), found->dst), &fstat) && fstat.st_size == size)  return 1;
+    }
+}
+
+/*
+ * An album is fingerprinted by the modified dates of its dir on the Palm and of its backup dir, and by
+ * the used bytes of its volume, so it needs not to be enumerated again, as long as none of them changes.
+ */
+static albumPrint *albumPrintLookup(const char *key) {
+    for (albumPrint *print = albumPrints; print; print = print->next) {
+        if (!strcmp(print->key, key))  return print;
+    }
+    return NULL;
+}
+
+static albumPrint *albumPrintPut(const char *key, time_t date, time_t dstDate, uint32_t dstNsec, int64_t volumeUsed, uint32_t files,
+        uint32_t rechecks, uint64_t captions, uint32_t dirs) {
+    albumPrint *print;
+
+    if (!(print = albumPrintLookup(key))) {
+        if (!(print = mallocLog(sizeof(*print) + strlen(key) + 1)))  return NULL;
+        strcpy(print->key, key);
+        print->next = albumPrints;
+        albumPrints = print;
+    } else if (print->date == date && print->dstDate == dstDate && print->dstNsec == dstNsec && print->volumeUsed == volumeUsed &&
+            print->files == files && print->rechecks == rechecks && print->captions == captions && print->dirs == dirs) {
+        return print;
+    }
+    print->date = date;
+    print->dstDate = dstDate;
+    print->dstNsec = dstNsec;
+    print->volumeUsed = volumeUsed;
+    print->files = files;
+    print->rechecks = rechecks;
+    print->captions = captions;
+    print->dirs = dirs;
+    manifestDirty = 1;
+    return print;
+}
+
+/*
+ * Copy the fingerprint of the album of key to print, without its key.
+ * Returns 1, or 0 if there is none.
+ */
+int albumPrintGet(const char *key, albumPrint *print) {
+    albumPrint *found;
+
+    pthread_mutex_lock(&manifestLock);
+    if ((found = albumPrintLookup(key)))  memcpy(print, found, sizeof(*print));
+    pthread_mutex_unlock(&manifestLock);
+    return !!found;
+}
+
+void albumPrintUpdate(const char *key, time_t date, time_t dstDate, uint32_t dstNsec, int64_t volumeUsed, uint32_t files,
+        uint32_t rechecks, uint64_t captions, uint32_t dirs) {
+    pthread_mutex_lock(&manifestLock);
+    albumPrintPut(key, date, dstDate, dstNsec, volumeUsed, files, rechecks, captions, dirs);
+    pthread_mutex_unlock(&manifestLock);
+}
+
+/*
+ * Let the fingerprint of the album of key never match again, until it is updated.
+ */
+void albumPrintInvalidate(const char *key) {
+    albumPrint *print;
+
+    pthread_mutex_lock(&manifestLock);
+    if ((print = albumPrintLookup(key)) && print->volumeUsed != -1) {
+        print->volumeUsed = -1;
+        manifestDirty = 1;
+    }
+    pthread_mutex_unlock(&manifestLock);
+}
+
+/*
+ * Record print of an album done by albumDone() with the date of its backup dir, which no longer changes by
+ * the sync. With sub-second dates, any later change of the dir shows, but with whole seconds, one within the
+ * same second could go unnoticed, so a dir modified within the last second is checked again next time.
+ */
+static void albumPrintRecord(const albumPrint *print) {
+    const char *dstDir = print->key + strlen(print->key) + 1;
+    struct stat dstStat;
+
+    if (stat(dstDir, &dstStat)) {
+        albumPrintInvalidate(print->key);
+        return;
+    }
+    albumPrintUpdate(print->key, print->date, dstStat.st_mtim.tv_nsec || dstStat.st_mtime < time(NULL) - 1 ? dstStat.st_mtime : 0,
+            dstStat.st_mtim.tv_nsec, print->volumeUsed, print->files, print->rechecks, print->captions, print->dirs);
+}
+
+/*
+ * Create dstPath as hard link to the backup below pcPath, which was found by contentFind().
+ * Returns 0, or -1 on error, i.e. if the backup is on another file system.
+ */
+int contentLink(const manifestInfo *same, const char *pcPath, const char *dstPath) {
+    char path[strlen(pcPath) + strlen(same->dst) + 2];
+
+    return link(strcat(strcat(strcpy(path, pcPath), "/"), same->dst), dstPath) ? -1 : 0;
+}
+
+static void manifestClear(void) {
+    for (unsigned i = 0; manifest && i < manifestBuckets; i++) {
+        for (manifestEntry *e, *next = manifest[i]; (e = next);) {
+            next = e->next;
+            free(e);
+        }
+    }
+    for (albumPrint *print; (print = albumPrints);) {
+        albumPrints = print->next;
+        free(print);
+    }
+    free(manifest);
+    free(contentIndex);
+    manifest = NULL;
+    contentIndex = NULL;
+    manifestCount = 0;
+}
+
+/*
+ * Load the manifest, unless it was already loaded by a former or concurrent sync.
+ */
+int manifestLoad(void) {
+    char path[256];
+    FILE *stream;
+    unsigned char *buf = NULL;
+    long len;
+    int result = -1;
+
+    pthread_mutex_lock(&manifestLock);
+    if (manifest) {
+        pthread_mutex_unlock(&manifestLock);
+        return 0;
+    }
+    manifestClear();
+    if (manifestInit(1024) < 0 || jp_get_home_file_name(MANIFEST_FILE, path, sizeof(path)) < 0) {
+        pthread_mutex_unlock(&manifestLock);
+        return -1;
+    }
+    if (!(stream = fopen(path, "rb"))) {
+        pthread_mutex_unlock(&manifestLock);
+        return errno == ENOENT ? 0 : -1; // first sync, nothing fetched yet
+    }
+    if (fseek(stream, 0, SEEK_END) || (len = ftell(stream)) < 0 || fseek(stream, 0, SEEK_SET) ||
+            !(buf = mallocLog(len + 1)) || fread(buf, 1, len, stream) != len) {
+        goto Exit;
+    }
+    if (len < sizeof(MANIFEST_MAGIC) || memcmp(buf, MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC))) {
+        jp_logf(L_WARN, "%s: WARNING: Manifest '%s' has unknown format, so ignoring it\n", MYNAME, path);
+        result = 0;
+        goto Exit;
+    }
+    for (unsigned char *p = buf + sizeof(MANIFEST_MAGIC), *end = buf + len; p < end;) {
+        if (end - p < 5)  goto Exit; // truncated
+        unsigned type = p[0], keyLen = getLE(p + 1, 2), dataLen = getLE(p + 3, 2);
+        char *key = (char *)p + 5;
+        unsigned char *data = p + 5 + keyLen;
+        if ((p = data + dataLen) > end)  goto Exit; // truncated
+        if (type == MANIFEST_FILE_ENTRY && dataLen >= 12) {
+            char keyStr[keyLen + 1], dst[dataLen - 12 + 1];
+            memcpy(keyStr, key, keyLen);  keyStr[keyLen] = 0;
+            memcpy(dst, data + 12, dataLen - 12);  dst[dataLen - 12] = 0;
+            if (!manifestPut(keyStr, getLE(data, 4), (time_t)(int64_t)getLE(data + 4, 8), dst))  goto Exit;
+        } else if (type == MANIFEST_CONTENT_DIGEST && dataLen >= 8) {
+            char keyStr[keyLen + 1];
+            memcpy(keyStr, key, keyLen);  keyStr[keyLen] = 0;
+            manifestSetDigest(manifestLookup(keyStr), getLE(data, 8));
+        } else if (type == MANIFEST_ALBUM_PRINT && dataLen >= 32) {
+            char keyStr[keyLen + 1];
+            memcpy(keyStr, key, keyLen);  keyStr[keyLen] = 0;
+            if (!albumPrintPut(keyStr, (time_t)(int64_t)getLE(data, 8), (time_t)(int64_t)getLE(data + 8, 8),
+                    dataLen >= 48 ? getLE(data + 36, 4) : 0, (int64_t)getLE(data + 16, 8), getLE(data + 24, 4),
+                    getLE(data + 28, 4), dataLen >= 48 ? getLE(data + 40, 8) : 0,
+                    dataLen >= 36 ? getLE(data + 32, 4) : ALBUM_DIRS_UNKNOWN))  goto Exit;
+        }
+    }
+    manifestDirty = 0;
+    result = 0;
+    jp_logf(L_DEBUG, "%s: Loaded %u entries from manifest '%s'\n", MYNAME, manifestCount, path);
+Exit:
+    if (result < 0)
+        jp_logf(L_WARN, "%s: WARNING: Manifest '%s' is damaged, loaded %u entries\n", MYNAME, path, manifestCount);
+    pthread_mutex_unlock(&manifestLock);
+    free(buf);
+    fclose(stream);
+    return result;
+}
+
+int manifestSave(void) {
+    char path[256], tmpPath[260];
+    FILE *stream;
+    int result = 0;
+
+    pthread_mutex_lock(&manifestLock);
+    if (!manifest || !manifestDirty) {
+        pthread_mutex_unlock(&manifestLock);
+        return 0;
+    }
+    if (jp_get_home_file_name(MANIFEST_FILE, path, sizeof(path)) < 0 ||
+            !(stream = fopen(strcat(strcpy(tmpPath, path), ".tmp"), "wb"))) {
+        pthread_mutex_unlock(&manifestLock);
+        return -1;
+    }
+    if (fwrite(MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC), 1, stream) != 1)  result = -1;
+    for (unsigned i = 0; i < manifestBuckets && !result; i++) {
+        for (manifestEntry *e = manifest[i]; e && !result; e = e->next) {
+            size_t keyLen = strlen(e->key), dstLen = strlen(e->dst);
+            unsigned char head[5 + 12], *p = head;
+            if (keyLen > 0xffff || 12 + dstLen > 0xffff)  continue;
+            *p++ = MANIFEST_FILE_ENTRY;
+            p = putLE(p, keyLen, 2);
+            p = putLE(p, 12 + dstLen, 2);
+            if (fwrite(head, 5, 1, stream) != 1 || fwrite(e->key, 1, keyLen, stream) != keyLen)  result = -1;
+            p = putLE(p, e->size, 4);
+            p = putLE(p, (int64_t)e->date, 8);
+            if (fwrite(head + 5, 12, 1, stream) != 1 || fwrite(e->dst, 1, dstLen, stream) != dstLen)  result = -1;
+            if (!e->hasDigest)  continue;
+            p = head;
+            *p++ = MANIFEST_CONTENT_DIGEST;
+            p = putLE(p, keyLen, 2);
+            p = putLE(p, 8, 2);
+            p = putLE(p, e->digest, 8);
+            if (fwrite(head, 5, 1, stream) != 1 || fwrite(e->key, 1, keyLen, stream) != keyLen || fwrite(head + 5, 8, 1, stream) != 1)
+                result = -1;
+        }
+    }
+    for (albumPrint *print = albumPrints; print && !result; print = print->next) {
+        size_t keyLen = strlen(print->key);
+        unsigned char head[5 + 48], *p = head;
+        if (keyLen > 0xffff)  continue;
+        *p++ = MANIFEST_ALBUM_PRINT;
+        p = putLE(p, keyLen, 2);
+        p = putLE(p, 48, 2);
+        p = putLE(p, (int64_t)print->date, 8);
+        p = putLE(p, (int64_t)print->dstDate, 8);
+        p = putLE(p, print->volumeUsed, 8);
+        p = putLE(p, print->files, 4);
+        p = putLE(p, print->rechecks, 4);
+        p = putLE(p, print->dirs, 4);
+        p = putLE(p, print->dstNsec, 4);
+        p = putLE(p, print->captions, 8);
+        if (fwrite(head, 5, 1, stream) != 1 || fwrite(print->key, 1, keyLen, stream) != keyLen || fwrite(head + 5, 48, 1, stream) != 1)
+            result = -1;
+    }
+    if (fclose(stream) || result || rename(tmpPath, path)) {
+        unlink(tmpPath);
+        pthread_mutex_unlock(&manifestLock);
+        return -1;
+    }
+    manifestDirty = 0;
+    jp_logf(L_DEBUG, "%s: Saved %u entries to manifest '%s'\n", MYNAME, manifestCount, path);
+    pthread_mutex_unlock(&manifestLock);
+    return 0;
+}
+
+void manifestFree(void) {
+    pthread_mutex_lock(&manifestLock);
+    manifestClear();
+    pthread_mutex_unlock(&manifestLock);
+}
+
+/*
+ * Check by the manifest, whether a file was already fetched, and its backup below pcPath still exists,
+ * without opening it on the Palm.
+ */
+int manifestFetched(syncSession *session, const char *card, const char *srcDir, const char *file) {
+    char key[sizeof(session->device) + strlen(card) + strlen(srcDir) + strlen(file) + 4];
+    manifestInfo e;
+    struct stat fstat;
+
+    if (!manifestGet(manifestKey(key, sizeof(key), session->device, card, srcDir, file), &e))  return 0;
+    char dstPath[strlen(session->pcPath) + strlen(e.dst) + 2];
+    strcat(strcat(strcpy(dstPath, session->pcPath), "/"), e.dst);
+    return !localStat(session->local, dstPath, &fstat) && fstat.st_size == e.size;
+}
+
+/*
+ * List the files of the album of albumKey in the manifest, whose type is listed in types, but not those of
+ * nested albums, as names each terminated by '\0', followed by an empty name.
+ * Returns the list to be freed, or NULL if out of memory.
+ */
+static char *manifestAlbumFiles(const char *albumKey, const char *types) {
+    size_t keyLen = strlen(albumKey), len = 1;
+    char *names, *p;
+
+    pthread_mutex_lock(&manifestLock);
+    for (unsigned i = 0; manifest && i < manifestBuckets; i++) {
+        for (manifestEntry *e = manifest[i]; e; e = e->next) {
+            if (!strncmp(e->key, albumKey, keyLen) && !strchr(e->key + keyLen, '/') && fileTypeListed(types, e->key + keyLen))
+                len += strlen(e->key + keyLen) + 1;
+        }
+    }
+    if ((p = names = mallocLog(len))) {
+        for (unsigned i = 0; manifest && i < manifestBuckets; i++) {
+            for (manifestEntry *e = manifest[i]; e; e = e->next) {
+                if (!strncmp(e->key, albumKey, keyLen) && !strchr(e->key + keyLen, '/') && fileTypeListed(types, e->key + keyLen))
+                    p += strlen(strcpy(p, e->key + keyLen)) + 1;
+            }
+        }
+        *p = '\0';
+    }
+    pthread_mutex_unlock(&manifestLock);
+    return names;
+}
+
+/*
+ * Hash file of quickCheckTypes with its date on the Palm, to be summed up over its album, so the sum changes,
+ * if any of them is recorded anew.
+ */
+static uint64_t captionSum(const char *file, time_t date) {
+    xxh64State state;
+    unsigned char le[8];
+
+    xxh64Init(&state);
+    xxh64Update(&state, file, strlen(file) + 1);
+    putLE(le, (int64_t)date, 8);
+    xxh64Update(&state, le, sizeof(le));
+    return xxh64Digest(&state);
+}
+
+/*
+ * A dirIndex holds the names in a directory on the PC, read once per album, so existence checks and
+ * finding a free name on collisions need no stat() per file.
+ */
+static char **dirIndexSlot(const dirIndex *index, const char *name) {
+    unsigned i = strHash(name) & (index->size - 1);
+    while (index->names[i] && strcmp(index->names[i], name))  i = (i + 1) & (index->size - 1);
+    return &index->names[i];
+}
+
+int dirIndexContains(const dirIndex *index, const char *name) {
+    return index->size && *dirIndexSlot(index, name);
+}
+
+int dirIndexAdd(dirIndex *index, const char *name) {
+    char **slot;
+
+    if (2 * (index->count + 1) > index->size) {
+        dirIndex grown = {index->size ? 2 * index->size : 64, index->count, NULL};
+        if (!(grown.names = calloc(grown.size, sizeof(*grown.names)))) {
+            jp_logf(L_FATAL, "%s: ERROR: Out of memory\n", MYNAME);
+            return -1;
+        }
+        for (unsigned i = 0; i < index->size; i++) {
+            if (index->names[i])  *dirIndexSlot(&grown, index->names[i]) = index->names[i];
+        }
+        free(index->names);
+        *index = grown;
+    }
+    if (*(slot = dirIndexSlot(index, name)))  return 0; // already known
+    if (!(*slot = mallocLog(strlen(name) + 1)))  return -1;
+    strcpy(*slot, name);
+    index->count++;
+    return 0;
+}
+
+void dirIndexFree(dirIndex *index) {
+    for (unsigned i = 0; i < index->size; i++)  free(index->names[i]);
+    free(index->names);
+    memset(index, 0, sizeof(*index));
+}
+
+/*
+ * Read the names in directory path into index by one pass, or take them from local, if it has path.
+ * Returns 0, or -1 on error.
+ */
+int dirIndexLoad(dirIndex *index, const char *path, const localIndex *local) {
+    DIR *dir;
+    struct dirent *entry;
+    const localEntry *e;
+    int result = 0;
+
+    if (local && (e = localLookup(local, path)) && S_ISDIR(e->mode)) {
+        for (e = e->children; !result && e; e = e->sibling)  result = dirIndexAdd(index, strrchr(e->path, '/') + 1);
+        return result;
+    }
+    if (!(dir = opendir(path)))  return -1;
+    while (!result && (entry = readdir(dir))) {
+        result = dirIndexAdd(index, entry->d_name);
+    }
+    closedir(dir);
+    return result;
+}
+
+/*
+ * A localIndex holds the paths and stat() results of all entries below the Media folder. It is scanned
+ * by engineWarmUp() in the background, while the device connects, so a sync following needs no stat()
+ * of known copies. It is a snapshot, so paths missing in it may have been created meanwhile, and paths in
+ * it may have been deleted meanwhile, so it is used only by syncs starting within WARM_MAX_AGE.
+ */
+static const localEntry *localLookup(const localIndex *index, const char *path) {
+    if (!index->size)  return NULL;
+    localEntry *e = index->buckets[strHash(path) & (index->size - 1)];
+    while (e && strcmp(e->path, path))  e = e->next;
+    return e;
+}
+
+static localEntry *localAdd(localIndex *index, const char *path, const struct stat *fstat) {
+    localEntry *e;
+
+    if (index->count >= 2 * index->size) {
+        localIndex grown = {index->size ? 2 * index->size : 1024, index->count, NULL};
+        if (!(grown.buckets = calloc(grown.size, sizeof(*grown.buckets)))) {
+            jp_logf(L_FATAL, "%s: ERROR: Out of memory\n", MYNAME);
+            return NULL;
+        }
+        for (unsigned i = 0; i < index->size; i++) {
+            for (localEntry *next; (e = index->buckets[i]); index->buckets[i] = next) {
+                next = e->next;
+                e->next = grown.buckets[strHash(e->path) & (grown.size - 1)];
+                grown.buckets[strHash(e->path) & (grown.size - 1)] = e;
+            }
+        }
+        free(index->buckets);
+        *index = grown;
+    }
+    if (!(e = mallocLog(sizeof(*e) + strlen(path) + 1)))  return NULL;
+    strcpy(e->path, path);
+    e->sibling = e->children = NULL;
+    e->size = fstat->st_size;
+    e->mtime = fstat->st_mtime;
+    e->mtimeNsec = fstat->st_mtim.tv_nsec;
+    e->mode = fstat->st_mode;
+    e->next = index->buckets[strHash(path) & (index->size - 1)];
+    index->buckets[strHash(path) & (index->size - 1)] = e;
+    index->count++;
+    return e;
+}
+
+/*
+ * Add the entries below directory dir to index, recursively, but not below symlinked directories.
+ * Returns 0, or -1 on error.
+ */
+static int localScan(localIndex *index, localEntry *dir) {
+    DIR *dirStream;
+    struct dirent *entry;
+    struct stat fstat;
+    int result = 0;
+
+    if (!(dirStream = opendir(dir->path)))  return -1;
+    while (!result && (entry = readdir(dirStream))) {
+        char path[strlen(dir->path) + strlen(entry->d_name) + 2];
+        localEntry *e;
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))  continue;
+        if (stat(strcat(strcat(strcpy(path, dir->path), "/"), entry->d_name), &fstat))  continue; // vanished
+        if (!(e = localAdd(index, path, &fstat))) {
+            result = -1;
+        } else {
+            e->sibling = dir->children;
+            dir->children = e;
+            // Symlinked dirs are not walked, as a link to an upper dir would never end.
+            if (S_ISDIR(fstat.st_mode) && !lstat(path, &fstat) && S_ISDIR(fstat.st_mode))  result = localScan(index, e);
+        }
+    }
+    closedir(dirStream);
+    return result;
+}
+
+/*
+ * Like stat(), but take the result from index, if it has path.
+ */
+static int localStat(const localIndex *index, const char *path, struct stat *fstat) {
+    const localEntry *e;
+
+    if (!index || !(e = localLookup(index, path)))  return stat(path, fstat);
+    memset(fstat, 0, sizeof(*fstat));
+    fstat->st_size = e->size;
+    fstat->st_mtime = e->mtime;
+    fstat->st_mtim.tv_nsec = e->mtimeNsec;
+    fstat->st_mode = e->mode;
+    return 0;
+}
+
+static void localFree(localIndex *index) {
+    for (unsigned i = 0; i < index->size; i++) {
+        for (localEntry *e; (e = index->buckets[i]);) {
+            index->buckets[i] = e->next;
+            free(e);
+        }
+    }
+    free(index->buckets);
+    memset(index, 0, sizeof(*index));
+}
+
+static void *warmUp(void *unused) {
+    char pcPath[256];
+    struct stat fstat;
+    localEntry *root;
+    double start = monotonicSecs();
+
+    if (manifestLoad() < 0)
+        jp_logf(L_WARN, "%s: WARNING: Could not load manifest '%s', so check all files on the Palm\n", MYNAME, MANIFEST_FILE);
+    if (jp_get_home_file_name(PCDIR, pcPath, sizeof(pcPath)) < 0)  strcpy(pcPath, PCDIR);
+    if (stat(pcPath, &fstat) || !(root = localAdd(&warmIndex, pcPath, &fstat)) || localScan(&warmIndex, root) < 0) {
+        jp_logf(L_DEBUG, "%s: Could not scan '%s' in advance\n", MYNAME, pcPath);
+        localFree(&warmIndex);
+    } else {
+        jp_logf(L_DEBUG, "%s: Scanned %u entries of '%s' in %.3f s\n", MYNAME, warmIndex.count, pcPath, monotonicSecs() - start);
+    }
+    pthread_mutex_lock(&warmLock);
+    warmDone = monotonicSecs();
+    warmState = WARM_READY;
+    pthread_cond_broadcast(&warmFinished);
+    pthread_mutex_unlock(&warmLock);
+    return NULL;
+}
+
+/*
+ * Wait until the scan of the Media folder is finished, and join its thread. To be called with warmLock held.
+ */
+static void warmWait(void) {
+    while (warmState == WARM_RUNNING)  pthread_cond_wait(&warmFinished, &warmLock);
+    if (warmJoinable)  pthread_join(warmThread, NULL); // returns at once after signalling
+    warmJoinable = 0;
+}
+
+/*
+ * Start loading the manifest and scanning the Media folder by a thread, unless already done recently enough,
+ * i.e. JPilot calls it, when it starts waiting for the handshake, and again when the device came.
+ */
+void engineWarmUp(void) {
+    pthread_mutex_lock(&claimLock);
+    pthread_mutex_lock(&warmLock);
+    if (warmState == WARM_READY && !runningSessions && monotonicSecs() - warmDone > WARM_MAX_AGE) {
+        jp_logf(L_DEBUG, "%s: Scan of '%s' is older than %.0f s, so scanning again\n", MYNAME, PCDIR, WARM_MAX_AGE);
+        warmWait();
+        localFree(&warmIndex);
+        warmState = WARM_NONE;
+    }
+    if (warmState == WARM_NONE && !pthread_create(&warmThread, NULL, warmUp, NULL)) {
+        warmState = WARM_RUNNING;
+        warmJoinable = 1;
+    }
+    pthread_mutex_unlock(&warmLock);
+    pthread_mutex_unlock(&claimLock);
+}
+
+/*
+ * Claim path for the fetch of one file, so no other session writes to it meanwhile.
+ * If wait is set, wait while another session holds it, otherwise return 1 in that case.
+ * Returns 0 if claimed. A session must not wait, while it holds a claim, other than by its queued files.
+ */
+static int claimPath(pathClaim *claim, const char *path, int wait) {
+    int busy;
+
+    pthread_mutex_lock(&claimLock);
+    do {
+        busy = 0;
+        for (pathClaim *other = pathClaims; other && !busy; other = other->next)  busy = !strcmp(other->path, path);
+    } while (busy && wait && !pthread_cond_wait(&claimReleased, &claimLock));
+    if (!busy) {
+        claim->path = path;
+        claim->next = pathClaims;
+        pathClaims = claim;
+    }
+    pthread_mutex_unlock(&claimLock);
+    return busy;
+}
+
+static void releasePath(pathClaim *claim) {
+    if (!claim->path)  return;
+    pthread_mutex_lock(&claimLock);
+    for (pathClaim **link = &pathClaims; *link; link = &(*link)->next) {
+        if (*link == claim) {
+            *link = claim->next;
+            break;
+        }
+    }
+    claim->path = NULL;
+    pthread_cond_broadcast(&claimReleased);
+    pthread_mutex_unlock(&claimLock);
+}
+
+/*
+ * Hand the claim of path over from claim to the claim to, which holds it then.
+ */
+static void movePath(pathClaim *claim, pathClaim *to, const char *path) {
+    pthread_mutex_lock(&claimLock);
+    for (pathClaim **link = &pathClaims; *link; link = &(*link)->next) {
+        if (*link == claim) {
+            *link = claim->next;
+            break;
+        }
+    }
+    claim->path = NULL;
+    to->path = path;
+    to->next = pathClaims;
+    pathClaims = to;
+    pthread_mutex_unlock(&claimLock);
+}
+
+/*
+ * Remember a created destination path, as the directory indexes of other sessions may miss it.
+ */
+static void pathCreated(const char *path) {
+    pthread_mutex_lock(&claimLock);
+    dirIndexAdd(&createdPaths, path);
+    pthread_mutex_unlock(&claimLock);
+}
+
+/*
+ * Count the sessions running, and drop what they share, when the last one ends.
+ */
+static void sessionsRunning(int delta) {
+    pthread_mutex_lock(&claimLock);
+    if (!(runningSessions += delta)) {
+        dirIndexFree(&createdPaths);
+        pthread_mutex_lock(&warmLock);
+        if (warmState == WARM_READY) {
+            warmWait();
+            localFree(&warmIndex);
+            warmState = WARM_NONE;
+        }
+        pthread_mutex_unlock(&warmLock);
+    }
+    pthread_mutex_unlock(&claimLock);
+}
+
+/*
+ * Check whether name exists in the directory of index, or if index is NULL, whether path exists, or
+ * whether path was created by a sync, as it may still be a part file.
+ */
+static int dstExists(const dirIndex *index, const char *path, const char *name) {
+    struct stat fstat;
+    int created;
+
+    if (index ? dirIndexContains(index, name) : !stat(path, &fstat))  return 1;
+    pthread_mutex_lock(&claimLock);
+    created = dirIndexContains(&createdPaths, path);
+    pthread_mutex_unlock(&claimLock);
+    return created;
+}
+
+/*
+ * Like dlp_VFSVolumeInfo(), but asking the Palm only once per volume and sync.
+ */
+static volumeCache *volumeCached(syncSession *session, const int volRef) {
+    for (unsigned i = 0; i < session->volumeInfoCount; i++) {
+        if (session->volumeInfos[i].volRef == volRef)  return &session->volumeInfos[i];
+    }
+    if (session->volumeInfoCount == VOLUME_CACHE)  return NULL;
+    volumeCache *volume = &session->volumeInfos[session->volumeInfoCount++];
+    memset(volume, 0, sizeof(*volume));
+    volume->volRef = volRef;
+    return volume;
+}
+
+int volumeInfo(syncSession *session, const int volRef, VFSInfo *volInfo) {
+    volumeCache *volume = volumeCached(session, volRef);
+    PI_ERR result;
+
+    if (volume && volume->hasInfo) {
+        *volInfo = volume->info;
+        return 0;
+    }
+    if ((result = DLP(session, DLP_VOLUME_INFO, PHASE_ENUMERATE, dlp_VFSVolumeInfo(session->sd, volRef, volInfo))) >= 0 && volume) {
+        volume->info = *volInfo;
+        volume->hasInfo = 1;
+    }
+    return result;
+}
+
+/*
+ * Return the used bytes of volume volRef, asking the Palm only once per volume and sync, or -1 on error.
+ */
+long volumeUsed(syncSession *session, const int volRef) {
+    volumeCache *volume = volumeCached(session, volRef);
+    long used, total;
+
+    if (volume && volume->hasUsed)  return volume->used;
+    if (DLP(session, DLP_VOLUME_SIZE, PHASE_ENUMERATE, dlp_VFSVolumeSize(session->sd, volRef, &used, &total)) < 0)  return -1;
+    if (volume) {
+        volume->used = used;
+        volume->hasUsed = 1;
+    }
+    return used;
+}
+
+/*
+ * Return directory name on the PC, where the album should be stored. Returned string is of the form
+ * "$JPILOT_HOME/.jpilot/$PCDIR/Album/". Directories in the path are created as needed.
+ * The name of the card directory is copied to card, which must hold 16 chars.
+ * Null is returned if out of memory.
+ * Caller should free return value.
+ */
+char *destinationDir(syncSession *session, const unsigned volRef, const char *name, char *card) {
+    char *path;
+    VFSInfo volInfo;
+
+    if (!(path = mallocLog(strlen(session->pcPath) + 16 + (name ? strlen(name) : 0) + 3))) {
+        return path;
+    }
+
+    // Get indicator of which card.
+    if (volumeInfo(session, volRef, &volInfo) < 0) {
+        jp_logf(L_FATAL, "%s:     ERROR: Could not get volume info from volRef %d\n", MYNAME, volRef);
+        free(path);
+        return NULL;
+    }
+    if (volInfo.mediaType == pi_mktag('T', 'F', 'F', 'S')) {
+        strcpy(card, "Internal");
+    } else if (volInfo.mediaType == pi_mktag('s', 'd', 'i', 'g')) {
+        strcpy(card, "SDCard");
+    } else {
+        sprintf(card, "card%d", volInfo.slotRefNum);
+    }
+
+    // Create album directory if not existent, and those of the albums it is nested in.
+    if (createDir(session, path, session->pcPath) || createDir(session, path, card)) {
+        free(path);
+        return NULL;
+    }
+    char part[name ? strlen(name) + 1 : 1];
+    for (const char *p = name; p && *p; p += *p == '/') {
+        size_t len = strcspn(p, "/");
+        memcpy(part, p, len);
+        part[len] = 0;
+        p += len;
+        if (len && createDir(session, path, part)) {
+            free(path);
+            return NULL;
+        }
+    }
+    return path; // must be free'd by caller
+}
+
+int fileRead(syncSession *session, FileRef fileRef, pi_buffer_t *buf, int filesize) {
+    pi_buffer_clear(buf);
+    for (int readsize = -1, todo = filesize > buf->allocated ? buf->allocated : filesize; todo > 0; todo -= readsize) {
+        readsize = DLP(session, DLP_FILE_READ, PHASE_NONE, dlp_VFSFileRead(session->sd, fileRef, buf, todo)); // part of compare phase
+        //readsize = dlp_VFSFileRead(sd, fileRef, buf, buf->allocated); // works too, but is very slow
+        if (readsize <= 0) {
+            jp_logf(L_FATAL, "%s:        ERROR: File read error; aborting at %d bytes left.\n", MYNAME, filesize - buf->used);
+            return readsize;
+        }
+    }
+    return (int)buf->used;
+}
+
+/*
+ * Return chunk size, which was tuned for card before, or 0 if not yet known.
+ * Pref tunedChunkSizes is of the form "card=size;card=size".
+ */
+long tunedChunkSize(const char *card) {
+    const char *tuned;
+    size_t len = strlen(card);
+    long size = 0;
+
+    pthread_mutex_lock(&prefsLock);
+    if (jp_get_pref(PREFS, PREF_TUNED_CHUNK_SIZES, NULL, &tuned) >= 0 && tuned) {
+        for (const char *p = tuned; (p = strstr(p, card)); p += len) {
+            if ((p == tuned || p[-1] == ';') && p[len] == '=') {
+                size = atol(p + len + 1);
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&prefsLock);
+    return size;
+}
+
+void setTunedChunkSize(const char *card, long size) {
+    const char *tuned;
+    size_t len = strlen(card);
+
+    pthread_mutex_lock(&prefsLock);
+    if (jp_get_pref(PREFS, PREF_TUNED_CHUNK_SIZES, NULL, &tuned) < 0) {
+        pthread_mutex_unlock(&prefsLock);
+        return;
+    }
+    if (!tuned)  tuned = "";
+    char updated[strlen(tuned) + len + 24], *out = updated;
+    for (const char *p = tuned, *end; *p; p = end + !!*end) { // keep entries of other cards
+        end = p + strcspn(p, ";");
+        if (end > p && !(!strncmp(p, card, len) && p[len] == '='))
+            out += sprintf(out, "%.*s;", (int)(end - p), p);
+    }
+    sprintf(out, "%s=%ld", card, size);
+    jp_set_pref(PREFS, PREF_TUNED_CHUNK_SIZES, 0, updated);
+    prefsDirty = 1;
+    pthread_mutex_unlock(&prefsLock);
+}
+
+/*
+ * While tuning, each of CHUNK_SIZES is used for CHUNK_PROBE_BYTES, measuring the time of the DLP reads.
+ */
+static int tunerChunk(const chunkTuner *tuner, int chunk) {
+    return tuner && tuner->candidate < CHUNK_CANDIDATES ? CHUNK_SIZES[tuner->candidate] : chunk;
+}
+
+static void tunerRecord(chunkTuner *tuner, long bytes, double secs) {
+    if (!tuner || tuner->candidate >= CHUNK_CANDIDATES)  return;
+    tuner->bytes[tuner->candidate] += bytes;
+    tuner->secs[tuner->candidate] += secs;
+    if (tuner->bytes[tuner->candidate] >= CHUNK_PROBE_BYTES)  tuner->candidate++;
+}
+
+/*
+ * Return the chunk size with the best throughput, or 0 if probing has not finished.
+ */
+int tunerBest(const chunkTuner *tuner) {
+    int best = 0;
+    double bestRate = 0;
+
+    if (tuner->candidate < CHUNK_CANDIDATES)  return 0;
+    for (int i = 0; i < CHUNK_CANDIDATES; i++) {
+        double rate = tuner->bytes[i] / (tuner->secs[i] > 0 ? tuner->secs[i] : 1e-9);
+        jp_logf(L_DEBUG, "%s:       Chunk size %6d: %.0f bytes/s\n", MYNAME, CHUNK_SIZES[i], rate);
+        if (rate > bestRate) {
+            bestRate = rate;
+            best = CHUNK_SIZES[i];
+        }
+    }
+    return best;
+}
+
+static void *pipeWriter(void *arg) {
+    copyPipe *pl = arg;
+
+    pthread_mutex_lock(&pl->lock);
+    for (;;) {
+        while (!pl->count && !pl->done)  pthread_cond_wait(&pl->cond, &pl->lock);
+        if (!pl->count)  break; // reader has finished
+        pi_buffer_t *buf = pl->bufs[pl->head];
+        pthread_mutex_unlock(&pl->lock);
+        double start = monotonicSecs();
+        size_t written = fwrite(buf->data, 1, buf->used, pl->stream);
+        if (pl->digest)  xxh64Update(pl->digest, buf->data, written);
+        pthread_mutex_lock(&pl->lock);
+        pl->writeSecs += monotonicSecs() - start;
+        pl->written += written;
+        if (written != buf->used) {
+            pl->error = 1;
+            pthread_cond_broadcast(&pl->cond);
+            break;
+        }
+        pl->head = (pl->head + 1) % PIPE_BUFFERS;
+        pl->count--;
+        pthread_cond_broadcast(&pl->cond);
+    }
+    pthread_mutex_unlock(&pl->lock);
+    return NULL;
+}
+
+/*
+ * Add the next n bytes of stream to digest, i.e. of a partial file to be continued, reading them into buf.
+ */
+int digestStream(FILE *stream, long n, xxh64State *digest, pi_buffer_t *buf) {
+    for (size_t len; n > 0; n -= len) {
+        if (!(len = fread(buf->data, 1, n < buf->allocated ? n : buf->allocated, stream)))  return -1;
+        xxh64Update(digest, buf->data, len);
+    }
+    return 0;
+}
+
+/*
+ * Map the first size bytes of the local file at path for reading, and advise the kernel of the access pattern.
+ * Returns the mapping to be released by munmap(), or NULL if empty or on error.
+ */
+static unsigned char *fileMap(const char *path, size_t size, int advice) {
+    void *map;
+    int fd;
+
+    if (!size || (fd = open(path, O_RDONLY)) < 0)  return NULL;
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)  return NULL;
+    madvise(map, size, advice);
+    return map;
+}
+
+/*
+ * Add the first n bytes of the local file at path to digest, in place by mapping it, or else reading it into buf.
+ * Returns 0, or -1 if the file could not be read.
+ */
+int digestFile(const char *path, long n, xxh64State *digest, pi_buffer_t *buf) {
+    unsigned char *map;
+    FILE *stream;
+    int result;
+
+    if ((map = fileMap(path, n, MADV_SEQUENTIAL))) {
+        xxh64Update(digest, map, n);
+        munmap(map, n);
+        return 0;
+    }
+    if (!(stream = fopen(path, "r")))  return -1;
+    result = digestStream(stream, n, digest, buf);
+    fclose(stream);
+    return result;
+}
+
+/*
+ * Copy filesize bytes from fileRef to the end of stream like fileCopy(), but without a writer thread nor stdio:
+ * The file, which must be preallocated to its final size, so a full disk can't raise SIGBUS on a store to the
+ * mapping, is mapped, so each DLP read is copied once from its buffer into the page cache of the file.
+ * The mapping itself is never handed to dlp_VFSFileRead(), as pilot-link may grow its buffer by realloc().
+ * On error the file is truncated to the bytes landed, and stream is positioned there.
+ * Returns as fileCopy(), or -3 if the file could not be mapped, so nothing was read.
+ */
+static int fileCopyMapped(syncSession *session, FileRef fileRef, FILE *stream, int filesize, int chunk, chunkTuner *tuner, xxh64State *digest) {
+    int fd = fileno(stream), result = 0;
+    long offset;
+    size_t size, pos;
+    unsigned char *map;
+    pi_buffer_t *buf = session->pipeBufs[0]; // not used by the pipe meanwhile
+    double copySecs = 0;
+
+    if (fflush(stream) || (offset = ftell(stream)) < 0)  return -3;
+    size = offset + filesize;
+    if ((map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)  return -3;
+    madvise(map, size, MADV_SEQUENTIAL);
+    for (pos = offset; pos < size;) {
+        int want = tunerChunk(tuner, chunk);
+        double start = tuner ? monotonicSecs() : 0;
+        pi_buffer_clear(buf);
+        if (DLP(session, DLP_FILE_READ, PHASE_READ, dlp_VFSFileRead(session->sd, fileRef, buf, (size - pos > want ? want : size - pos))) < 0 ||
+                !buf->used || buf->used > size - pos) {
+            jp_logf(L_FATAL, "\n%s:       ERROR: File read error; aborting at %zu bytes left.\n", MYNAME, size - pos);
+            result = -1;
+            break;
+        }
+        if (tuner)  tunerRecord(tuner, buf->used, monotonicSecs() - start);
+        start = monotonicSecs();
+        memcpy(map + pos, buf->data, buf->used);
+        if (digest)  xxh64Update(digest, buf->data, buf->used);
+        copySecs += monotonicSecs() - start;
+        pos += buf->used;
+    }
+    if (munmap(map, size) || (pos < size && ftruncate(fd, pos)) || fseek(stream, pos, SEEK_SET)) {
+        jp_logf(L_FATAL, "\n%s:       ERROR: File write error; aborting.\n", MYNAME);
+        result = -2;
+    }
+    statsPhase(&session->stats, PHASE_WRITE, copySecs, pos - offset);
+    return result;
+}
+
+/*
+ * Copy filesize bytes from fileRef to stream, which is preallocated for them, reading chunk bytes per DLP read,
+ * or probing chunk sizes by tuner, if given. Files larger than one chunk are copied through a mapping by
+ * fileCopyMapped(), or if the file can't be mapped, while a writer thread stores a buffer to the stream, the
+ * next buffers from the pool pipeBufs[] of session are already read from the Palm, so the link and the disk
+ * work in parallel. Files fitting in one chunk are copied directly. The written bytes are added to digest, if given.
+ * Returns 0, -1 on read error, or -2 on write error.
+ */
+int fileCopy(syncSession *session, FileRef fileRef, FILE *stream, int filesize, int chunk, chunkTuner *tuner, xxh64State *digest) {
+    copyPipe pl = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, stream, session->pipeBufs, 0, 0, 0, 0, 0, 0, digest};
+    pthread_t writer;
+    int pipelined, result = 0;
+
+    if (filesize > tunerChunk(tuner, chunk) && (result = fileCopyMapped(session, fileRef, stream, filesize, chunk, tuner, digest)) != -3)
+        return result;
+    result = 0;
+    pipelined = filesize > tunerChunk(tuner, chunk) && !pthread_create(&writer, NULL, pipeWriter, &pl);
+    for (int todo = filesize; todo > 0;) {
+        pthread_mutex_lock(&pl.lock);
+        while (pl.count == PIPE_BUFFERS && !pl.error)  pthread_cond_wait(&pl.cond, &pl.lock);
+        pi_buffer_t *buf = session->pipeBufs[(pl.head + pl.count) % PIPE_BUFFERS];
+        pthread_mutex_unlock(&pl.lock);
+        if (pl.error) {
+            jp_logf(L_FATAL, "\n%s:       ERROR: File write error; aborting at %d bytes left.\n", MYNAME, todo);
+            result = -2;
+            break;
+        }
+        int want = tunerChunk(tuner, chunk);
+        double start = tuner ? monotonicSecs() : 0;
+        pi_buffer_clear(buf);
+        if (DLP(session, DLP_FILE_READ, PHASE_READ, dlp_VFSFileRead(session->sd, fileRef, buf, (todo > want ? want : todo))) < 0 || !buf->used)  {
+        //if (dlp_VFSFileRead(sd, fileRef, buf, buf->allocated) < 0)  { // works too, but is very slow
+            jp_logf(L_FATAL, "\n%s:       ERROR: File read error; aborting at %d bytes left.\n", MYNAME, todo);
+            result = -1;
+            break;
+        }
+        if (tuner)  tunerRecord(tuner, buf->used, monotonicSecs() - start);
+        todo -= buf->used;
+        if (!pipelined) {
+            double start = monotonicSecs();
+            size_t written = fwrite(buf->data, 1, buf->used, stream);
+            if (digest)  xxh64Update(digest, buf->data, written);
+            pl.writeSecs += monotonicSecs() - start;
+            pl.written += written;
+            if (written != buf->used) {
+                jp_logf(L_FATAL, "\n%s:       ERROR: File write error; aborting at %d bytes left.\n", MYNAME, todo + buf->used);
+                result = -2;
+                break;
+            }
+            continue;
+        }
+        pthread_mutex_lock(&pl.lock);
+        pl.count++;
+        pthread_cond_broadcast(&pl.cond);
+        pthread_mutex_unlock(&pl.lock);
+    }
+    if (pipelined) {
+        pthread_mutex_lock(&pl.lock);
+        pl.done = 1;
+        pthread_cond_broadcast(&pl.cond);
+        pthread_mutex_unlock(&pl.lock);
+        pthread_join(writer, NULL);
+        if (pl.error) {
+            jp_logf(L_FATAL, "\n%s:       ERROR: File write error; aborting.\n", MYNAME);
+            result = -2;
+        }
+    }
+    statsPhase(&session->stats, PHASE_WRITE, pl.writeSecs, pl.written);
+    return result;
+}
+
+/*
+ * A partially fetched file is kept as "<dst>.part" together with a checkpoint "<dst>.part.ckpt", which
+ * holds the manifest key of the source file in the first line, and its size, date and the bytes done
+ * in the second line. So a later sync can continue at the bytes done, if the source file is unchanged.
+ */
+int partialCheckpoint(const char *partPath, const char *key, uint32_t size, time_t date, long done) {
+    char ckptPath[strlen(partPath) + 6];
+    FILE *stream;
+
+    if (!(stream = fopen(strcat(strcpy(ckptPath, partPath), ".ckpt"), "w")))  return -1;
+    fprintf(stream, "%s\n%lu %lld %ld\n", key, (unsigned long)size, (long long)date, done);
+    return fclose(stream) ? -1 : 0;
+}
+
+/*
+ * Return the bytes done of partPath, if its checkpoint matches the source file, otherwise 0.
+ * All bytes are done, if the part file was complete, but could not be renamed.
+ */
+long partialResumeOffset(const char *partPath, const char *key, uint32_t size, time_t date) {
+    char ckptPath[strlen(partPath) + 6], line[strlen(key) + 3];
+    unsigned long ckptSize;
+    long long ckptDate;
+    long done = 0;
+    FILE *stream;
+    struct stat fstat;
+
+    if (!(stream = fopen(strcat(strcpy(ckptPath, partPath), ".ckpt"), "r")))  return 0;
+    if (fgets(line, sizeof(line), stream) && !strncmp(line, key, strlen(key)) && line[strlen(key)] == '\n' &&
+            fscanf(stream, "%lu %lld %ld", &ckptSize, &ckptDate, &done) == 3 &&
+            ckptSize == size && ckptDate == date && done <= size &&
+            !stat(partPath, &fstat) && fstat.st_size >= done) {
+        jp_logf(L_DEBUG, "%s:      Found %ld bytes of '%s' from former sync.\n", MYNAME, done, partPath);
+    } else {
+        done = 0;
+    }
+    fclose(stream);
+    return done > 0 ? done : 0;
+}
+
+void partialRemove(const char *partPath) {
+    char ckptPath[strlen(partPath) + 6];
+
+    unlink(partPath);
+    unlink(strcat(strcpy(ckptPath, partPath), ".ckpt"));
+}
+
+/*
+ * Check by SAMPLE_SIZE bytes at its head, its tail and at blocks seeked evenly in between, whether fileRef
+ * has the same content as the local file at path, both of size. The blocks are shifted on each sync, so
+ * repeated syncs sample other parts. A file not larger than the samples is compared completely.
+ * Afterwards fileRef is positioned at its beginning again.
+ * Returns 1 if equal, 0 if not, or -1 if fileRef could not be positioned.
+ */
+int sampleEqual(syncSession *session, FileRef fileRef, const char *path, uint32_t size, int blocks) {
+    long offsets[blocks + 2], pos = 0, bytes = 0;
+    int count = 0, equal = 1;
+    unsigned char *map;
+    double start = monotonicSecs();
+
+    if (size <= (uint32_t)(blocks + 2) * SAMPLE_SIZE) {
+        for (long offset = 0; offset < size; offset += SAMPLE_SIZE)  offsets[count++] = offset;
+    } else {
+        long stride = (size - 2 * SAMPLE_SIZE) / (blocks ? blocks : 1);
+        unsigned shift = (unsigned)session->stats.date * 2654435761u;
+        offsets[count++] = 0;
+        for (int i = 0; i < blocks; i++)
+            offsets[count++] = SAMPLE_SIZE + i * stride + (stride > SAMPLE_SIZE ? shift % (stride - SAMPLE_SIZE) : 0);
+        offsets[count++] = size - SAMPLE_SIZE;
+    }
+    // The local file is compared in place, so only the sampled pages of it are read from disk.
+    if (!(map = fileMap(path, size, MADV_RANDOM)))  return 0;
+    for (int i = 0; i < count && equal; i++) {
+        int len = size - offsets[i] < SAMPLE_SIZE ? size - offsets[i] : SAMPLE_SIZE;
+        equal = (offsets[i] == pos ||
+                DLP(session, DLP_FILE_SEEK, PHASE_NONE, dlp_VFSFileSeek(session->sd, fileRef, vfsOriginBeginning, offsets[i])) >= 0) &&
+                fileRead(session, fileRef, session->palmBuf, len) == len && !memcmp(session->palmBuf->data, map + offsets[i], len);
+        pos = offsets[i] + len;
+        bytes += len;
+    }
+    munmap(map, size);
+    statsPhase(&session->stats, PHASE_COMPARE, monotonicSecs() - start, bytes);
+    if (DLP(session, DLP_FILE_SEEK, PHASE_NONE, dlp_VFSFileSeek(session->sd, fileRef, vfsOriginBeginning, 0)) < 0)  return -1;
+    return equal;
+}
+
+/*
+ * Tell, whether the type of file is listed in types, i.e. ".amr.qcp".
+ */
+int fileTypeListed(const char *types, const char *file) {
+    const char *ext = strrchr(file, '.');
+    size_t len = ext ? strlen(ext) : 0;
+    for (const char *type = types; ext && (type = strchr(type, '.')); type++) {
+        if (!strncasecmp(type, ext, len) && (type[len] == '.' || !type[len]))  return 1;
+    }
+    return 0;
+}
+
+/*
+ * Tell, whether the sampled compare (compareContent=2) of file has to be escalated to a full compare,
+ * because its type is listed in pref fullCompareTypes, or its date differs from the one of the last sync.
+ */
+int fullCompareRequired(const syncConfig *config, const char *key, const char *file, time_t date) {
+    manifestInfo e;
+    return fileTypeListed(config->fullCompareTypes, file) || (manifestGet(key, &e) && e.date != date);
+}
+
+/*
+ * Quick check, whether the backup with the same size as the Palm file of key is unchanged, by the date of
+ * the Palm file. This is recorded in the manifest, or else was set as modified time of the backup on fetch.
+ */
+int quickCheckEqual(const char *key, const struct stat *fstat, time_t date) {
+    manifestInfo e;
+    return manifestGet(key, &e) ? e.date == date : fstat->st_mtime == date;
+}
+
+/*
+ * Get the XXH64 of the existing backup at dstPath from the manifest entry of key, if it was recorded for
+ * the backup as it is now, otherwise by reading the backup once.
+ * Returns 0, or -1 if the backup could not be read.
+ */
+int backupDigest(syncSession *session, const char *key, const char *dstPath, const struct stat *fstat, uint64_t *digest) {
+    manifestInfo e;
+    xxh64State state;
+    int result;
+
+    if (manifestGet(key, &e) && e.hasDigest && e.size == fstat->st_size && e.date == fstat->st_mtime &&
+            !strcmp(e.dst, dstPath + strlen(session->pcPath) + 1)) {
+        *digest = e.digest;
+        return 0;
+    }
+    xxh64Init(&state);
+    result = digestFile(dstPath, fstat->st_size, &state, session->pcBuf);
+    *digest = xxh64Digest(&state);
+    return result;
+}
+
+/*
+ * If the manifest has recorded a backup of key in dstDir below pcPath under another name, i.e. an
+ * alternative name because of a collision before, copy that name to dstName, which has room for size chars.
+ */
+static void recordedName(const char *key, const char *pcPath, const char *dstDir, char *dstName, size_t size) {
+    manifestInfo e;
+    size_t pcLen = strlen(pcPath), dirLen;
+    const char *name;
+
+    if (!manifestGet(key, &e) || strncmp(dstDir, pcPath, pcLen) || dstDir[pcLen] != '/')  return;
+    dirLen = strlen(dstDir + pcLen + 1);
+    if (strncmp(e.dst, dstDir + pcLen + 1, dirLen) || e.dst[dirLen] != '/')  return;
+    if (!strchr(name = e.dst + dirLen + 1, '/') && strlen(name) < size)  strcpy(dstName, name);
+}
+
+/*
+ * Change the name in dstPath, which starts at dstName, to the first of "file_1.ext", "file_2.ext", ...
+ * not yet existing nor claimed by another session, and claim it. dstPath must have room for 12 more chars.
+ */
+static void alternativeName(const dirIndex *dstIndex, char *dstPath, char *dstName, const char *file, pathClaim *claim) {
+    const char *ext = strrchr(file, '.');
+    int baseLen = ext ? ext - file : strlen(file);
+
+    releasePath(claim);
+    for (unsigned n = 1; n == 1 || dstExists(dstIndex, dstPath, dstName) || claimPath(claim, dstPath, 0); n++) {
+        sprintf(dstName, "%.*s_%u%s", baseLen, file, n, ext ? ext : "");
+    }
+}
+
+/*
+ * Finish a fetched file at path: replace it by a hard link to identical content fetched before, if job->link
+ * is set. Links are made one at a time, so two files of the same content, both done at once, end up linked
+ * to one of them. The link needs no sync, as the file it replaces is already durable with the same content.
+ */
+static void deferRun(deferredJob *job) {
+    static pthread_mutex_t linkLock = PTHREAD_MUTEX_INITIALIZER;
+    const char *pcPath = job->session->pcPath;
+    double start = monotonicSecs();
+    manifestInfo same;
+    unsigned candidates = 0;
+
+    if (job->link) {
+        char linkPath[strlen(job->path) + 6];
+        pthread_mutex_lock(&linkLock);
+        if (contentFind(job->size, &job->digest, job->key, pcPath, &candidates, &same) &&
+                !contentLink(&same, pcPath, strcat(strcpy(linkPath, job->path), ".link"))) {
+            if (!(job->linked = !rename(linkPath, job->path)))  unlink(linkPath);
+        }
+        pthread_mutex_unlock(&linkLock);
+        if (job->linked)  trace(TRACE_FILE_LINKED, job->path, 0, 0, 0);
+    }
+    job->secs = monotonicSecs() - start;
+}
+
+/*
+ * Sync the file or directory at path to disk.
+ * Returns 0, or -1 on error.
+ */
+static int syncPath(const char *path) {
+    int fd, err;
+
+    if ((fd = open(path, O_RDONLY)) < 0)  return -1;
+    err = fsync(fd);
+    close(fd);
+    return err ? -1 : 0;
+}
+
+/*
+ * Make the files of batch durable, then finish them: First their part files are synced, then renamed to their
+ * names, and their directories synced, so a crash never leaves a name without its content. Only then they
+ * are recorded in the manifest, linked by deferRun(), and their claims released. Only the files and directories
+ * of the batch are synced, as syncing the whole file system would stall all other writers on each album.
+ * A part file, which can't be renamed, is kept, so the next sync renames it without fetching it again.
+ * Returns the seconds spent on syncing.
+ */
+static double deferBatchRun(deferredBatch *batch) {
+    const char *pcPath = batch->session->pcPath;
+    double start = monotonicSecs(), secs;
+    int err = 0;
+
+    for (deferredJob *job = batch->files; job; job = job->next) {
+        char partPath[strlen(job->path) + 6];
+        if (syncPath(strcat(strcpy(partPath, job->path), ".part")))  err = -1;
+    }
+    for (deferredJob *job = batch->files; job; job = job->next) {
+        const char *slash = strrchr(job->path, '/');
+        char partPath[strlen(job->path) + 6], dir[slash - job->path + 1];
+        strcat(strcpy(partPath, job->path), ".part");
+        if ((job->failed = rename(partPath, job->path) != 0)) {
+            jp_logf(L_FATAL, "%s:       ERROR: Cannot rename %s to %s.\n", MYNAME, partPath, job->path);
+            partialCheckpoint(partPath, job->key, job->size, job->date, job->size); // all done, so only to rename
+        } else {
+            partialRemove(partPath); // only the checkpoint is left
+        }
+        // The directory is synced after its last file of the batch.
+        if (job->next && !strncmp(job->next->path, job->path, slash - job->path + 1) &&
+                !strchr(job->next->path + (slash - job->path) + 1, '/'))  continue;
+        sprintf(dir, "%.*s", (int)(slash - job->path), job->path); // job->path is claimed, so left unchanged
+        if (syncPath(dir))  err = -1;
+    }
+    if (err)  jp_logf(L_WARN, "%s:    WARNING: Cannot sync the files fetched to '%s' to disk.\n", MYNAME, batch->files->path);
+    secs = monotonicSecs() - start;
+    for (deferredJob *job = batch->files; job; job = job->next) {
+        if (!job->failed) {
+            manifestUpdate(job->key, job->size, job->date, job->path + strlen(pcPath) + 1, &job->digest);
+            deferRun(job);
+        }
+        releasePath(&job->claim);
+    }
+    return secs;
+}
+
+static void *deferWorker(void *unused) {
+    deferredBatch *batch;
+
+    pthread_mutex_lock(&deferLock);
+    for (;;) {
+        while (!deferQueue && !deferStop)  pthread_cond_wait(&deferQueued, &deferLock);
+        if (!(batch = deferQueue))  break;
+        if (!(deferQueue = batch->next))  deferTail = &deferQueue;
+        pthread_mutex_unlock(&deferLock);
+        double secs = deferBatchRun(batch);
+        pthread_mutex_lock(&deferLock);
+        syncSession *session = batch->session;
+        session->syncSecs += secs;
+        for (deferredJob *job; (job = batch->files);) {
+            batch->files = job->next;
+            job->next = session->deferredDone;
+            session->deferredDone = job;
+        }
+        free(batch);
+        if (!--session->deferred)  pthread_cond_broadcast(&deferFinished);
+    }
+    pthread_mutex_unlock(&deferLock);
+    return NULL;
+}
+
+/*
+ * Remember a file fetched to the part file of path, to be finished by deferBatchRun() together with the other
+ * files of its album. The job takes over claim, so no other session uses path, until the file got its name.
+ * If out of memory, it is left as part file, which a later sync fetches again.
+ */
+static void deferFileDone(syncSession *session, const char *key, const char *path, uint32_t size, time_t date, uint64_t digest, int link,
+        pathClaim *claim) {
+    deferredJob *job;
+
+    if (!(job = mallocLog(sizeof(*job) + strlen(path) + strlen(key) + 2)))  return; // logged by mallocLog()
+    *job = (deferredJob){session->unsynced, session, session->stats.album, size, date, digest, link, 0, 0, {NULL}, 0, NULL};
+    job->key = strcpy(job->path + strlen(strcpy(job->path, path)) + 1, key);
+    movePath(claim, &job->claim, job->path);
+    session->unsynced = job;
+}
+
+/*
+ * Queue the files fetched to dir, or all if NULL, as one batch for the workers, see deferBatchRun().
+ * The workers are started on the first batch. If that fails, the batch is done at once.
+ */
+static void deferAlbumSync(syncSession *session, const char *dir) {
+    size_t len = dir ? strlen(dir) : 0;
+    deferredBatch *batch;
+    deferredJob **tail;
+
+    if (!session->unsynced || !(batch = mallocLog(sizeof(*batch))))  return;
+    *batch = (deferredBatch){NULL, session, NULL};
+    tail = &batch->files;
+    for (deferredJob **p = &session->unsynced, *job; (job = *p);) {
+        if (!dir || (!strncmp(job->path, dir, len) && job->path[len] == '/' && !strchr(job->path + len + 1, '/'))) {
+            *p = job->next;
+            *tail = job;
+            tail = &job->next;
+        } else {
+            p = &job->next;
+        }
+    }
+    *tail = NULL;
+    if (!batch->files) {
+        free(batch);
+        return;
+    }
+    pthread_mutex_lock(&deferLock);
+    for (; deferStarted < DEFER_WORKERS && !pthread_create(&deferWorkers[deferStarted], NULL, deferWorker, NULL); deferStarted++);
+    if (deferStarted) {
+        *deferTail = batch;
+        deferTail = &batch->next;
+        session->deferred++;
+        pthread_cond_signal(&deferQueued);
+    }
+    pthread_mutex_unlock(&deferLock);
+    if (deferStarted)  return;
+    double secs = deferBatchRun(batch);
+    pthread_mutex_lock(&deferLock);
+    session->syncSecs += secs;
+    *tail = session->deferredDone;
+    session->deferredDone = batch->files;
+    pthread_mutex_unlock(&deferLock);
+    free(batch);
+}
+
+/*
+ * Wait until the batches queued by session are done.
+ */
+static void deferWait(syncSession *session) {
+    pthread_mutex_lock(&deferLock);
+    while (session->deferred)  pthread_cond_wait(&deferFinished, &deferLock);
+    pthread_mutex_unlock(&deferLock);
+}
+
+static void deferShutdown(void) {
+    pthread_mutex_lock(&deferLock);
+    deferStop = 1;
+    pthread_cond_broadcast(&deferQueued);
+    pthread_mutex_unlock(&deferLock);
+    for (int i = 0; i < deferStarted; i++)  pthread_join(deferWorkers[i], NULL);
+    deferStarted = deferStop = 0;
+}
+
+/*
+ * Fetch a file and backup it, if not existent. The names in dstDir are looked up in dstIndex, if given.
+ * If the backup exists with the same size, and compareContent is set, the file is fetched to a temporary
+ * file, while computing its digest. If this equals the digest of the backup, the temporary file is
+ * dropped, otherwise it becomes the new backup under an alternative name. So the Palm file is read once.
+ * With compareContent=2 only samples are compared, unless fullCompareRequired().
+ * The filesize and date were got by planFile(), date is 0 if unknown.
+ */
+int fetchFileIfNeeded(syncSession *session, const unsigned volRef, const char *card, const char *srcDir, const char *dstDir,
+        dirIndex *dstIndex, const char *file, int filesize, time_t date) {
+    const syncConfig *config = session->config;
+    syncStats *stats = &session->stats;
+    char srcPath[strlen(srcDir) + strlen(file) + 2];
+    char dstPath[strlen(dstDir) + strlen(file) + 14]; // prepare for possible rename
+    char *dstName = dstPath + strlen(dstDir) + 1;
+    char partPath[sizeof(dstPath) + 5];
+    char key[sizeof(session->device) + strlen(card) + sizeof(srcPath) + 2];
+    FileRef fileRef;
+    uint32_t size = filesize; // filesize also serves as error return code
+    int dateErr = !date;
+
+    strcat(strcat(strcpy(srcPath, srcDir), "/"), file);
+    strcat(strcat(strcpy(dstPath, dstDir), "/"), file);
+
+    if (DLP(session, DLP_FILE_OPEN, PHASE_OPEN, dlp_VFSFileOpen(session->sd, volRef, srcPath, vfsModeRead, &fileRef)) < 0) {
+          jp_logf(L_FATAL, "%s:      ERROR: Could not open file '%s' on volume %d for reading.\n", MYNAME, srcPath, volRef);
+          return -1;
+    }
+    manifestKey(key, sizeof(key), session->device, card, srcDir, file);
+    recordedName(key, session->pcPath, dstDir, dstName, sizeof(dstPath) - (dstName - dstPath));
+    // Claim a copy, as dstPath may change to an alternative name, while a part file of this name is used.
+    char claimedPath[sizeof(dstPath)];
+    pathClaim claim, altClaim = {NULL};
+    if (claimPath(&claim, strcpy(claimedPath, dstPath), 0)) {
+        // The other session may wait for a file of ours, which keeps its claim until synced, so queue those first.
+        deferAlbumSync(session, NULL);
+        claimPath(&claim, claimedPath, 1);
+    }
+
+    struct stat fstat;
+    double start = monotonicSecs();
+    uint64_t backupSum;
+    int verify = 0; // fetch to compare with backupSum
+    int statErr = dstExists(dstIndex, dstPath, dstName) ? localStat(session->local, dstPath, &fstat) : -1;
+    if (!statErr) {
+        int equal = 0;
+        if (fstat.st_size != filesize) {
+            jp_logf(L_WARN, "%s:      WARNING: File '%s' already exists, but has different size %d vs. %d,\n", MYNAME, dstPath, fstat.st_size, filesize);
+        } else if (!config->compareContent && (!config->quickCheck || dateErr || quickCheckEqual(key, &fstat, date))) {
+            equal = 1;
+        } else if (!config->compareContent) {
+            // Changed date, so fetch it anyway, but keep it only if its content differs.
+            trace(TRACE_FILE_DATE_CHANGED, dstPath, 0, 0, 0);
+            if (!(verify = backupDigest(session, key, dstPath, &fstat, &backupSum) >= 0))
+                jp_logf(L_WARN, "%s:      WARNING: Cannot read %s for comparing %d bytes, so may have different content,\n", MYNAME, dstPath, filesize);
+        } else if (config->compareContent == 2 && !fullCompareRequired(config, key, file, date)) {
+            if ((equal = sampleEqual(session, fileRef, dstPath, size, SAMPLE_BLOCKS)) < 0) {
+                jp_logf(L_FATAL, "%s:       ERROR: On file seek; So can not compare '%s', aborting ...\n", MYNAME, file);
+                filesize = -1; // remember error
+                goto Exit;
+            } else if (!equal) {
+                jp_logf(L_WARN, "%s:      WARNING: File '%s' already exists, but has different content,\n", MYNAME, dstPath);
+            }
+            start = monotonicSecs(); // already recorded by sampleEqual()
+        } else if (backupDigest(session, key, dstPath, &fstat, &backupSum) < 0) {
+            jp_logf(L_WARN, "%s:      WARNING: Cannot read %s for comparing %d bytes, so may have different content,\n", MYNAME, dstPath, filesize);
+        } else {
+            verify = 1;
+        }
+        statsPhase(stats, PHASE_COMPARE, monotonicSecs() - start, 0);
+        if (equal) {
+            trace(TRACE_FILE_EXISTS, dstPath, 0, 0, 0);
+            manifestUpdate(key, size, date, dstPath + strlen(session->pcPath) + 1, NULL);
+            goto Exit;
+        }
+        if (!verify) {
+            // Find alternative destination file name, which not alredy exists, by inserting a number.
+            alternativeName(dstIndex, dstPath, dstName, file, &altClaim);
+            jp_logf(L_WARN, "%s:               so backup '%s' to '%s'.\n", MYNAME, file, dstPath);
+        }
+    }
+    // File has not already been backuped, fetch it.
+    // Open destination file, or continue a partial one left from a former sync.
+    FILE *dstStream = NULL;
+    xxh64State digest;
+    xxh64Init(&digest);
+    long done = partialResumeOffset(strcat(strcpy(partPath, dstPath), ".part"), key, size, date);
+    if (done > 0 && DLP(session, DLP_FILE_SEEK, PHASE_READ, dlp_VFSFileSeek(session->sd, fileRef, vfsOriginBeginning, done)) < 0) {
+        jp_logf(L_WARN, "%s:      WARNING: Cannot seek '%s' to %ld, so fetch it from start.\n", MYNAME, srcPath, done);
+        done = 0;
+    }
+    if (done > 0) {
+        jp_logf(L_GUI, "%s:      Continue %s %s at %ld ...", MYNAME, verify ? "comparing" : "fetching", dstPath, done);
+        if ((dstStream = fopen(partPath, "r+")) && (ftruncate(fileno(dstStream), done) ||
+                digestFile(partPath, done, &digest, session->pcBuf) || fseek(dstStream, done, SEEK_SET))) {
+            fclose(dstStream);
+            dstStream = NULL;
+        }
+    } else {
+        jp_logf(L_GUI, "%s:      %s %s ...", MYNAME, verify ? "Comparing" : "Fetching", dstPath);
+        if ((dstStream = fopen(partPath, "w+")) && partialCheckpoint(partPath, key, size, date, 0) < 0) {
+            fclose(dstStream);
+            dstStream = NULL;
+        }
+    }
+    if (!dstStream) {
+        jp_logf(L_FATAL, "\n%s:       ERROR: Cannot open %s for writing %d bytes!\n", MYNAME, partPath, filesize);
+        filesize = -1; // remember error
+        goto Exit;
+    }
+    // Allocate the whole file at once, so a full disk fails before fetching, and the file isn't fragmented.
+    int allocErr;
+    if (filesize > done && (allocErr = posix_fallocate(fileno(dstStream), done, filesize - done))) {
+        jp_logf(L_FATAL, "\n%s:       ERROR: Cannot allocate %d bytes for %s: %s\n", MYNAME, filesize, partPath, strerror(allocErr));
+        fclose(dstStream);
+        if (!done)  partialRemove(partPath);
+        filesize = -1; // remember error
+        goto Exit;
+    }
+    // Choose the bytes per DLP read, and tune them on the first large file, if not yet known for this card.
+    chunkTuner tuner = {0}, *tune = NULL;
+    int chunk = config->chunkSize;
+    if (!chunk && !(chunk = tunedChunkSize(card))) {
+        chunk = DEFAULT_CHUNK_SIZE;
+        if (filesize - done >= CHUNK_CANDIDATES * CHUNK_PROBE_BYTES)  tune = &tuner;
+    }
+    // Copy file.
+    int copyErr, fetched = filesize - done;
+    if ((copyErr = fileCopy(session, fileRef, dstStream, filesize - done, chunk, tune, &digest)) < 0) {
+        filesize = -1; // remember error
+    } else if (tune && (chunk = tunerBest(tune))) {
+        jp_logf(L_DEBUG, "%s:       Tuned chunk size for '%s' to %d bytes\n", MYNAME, card, chunk);
+        setTunedChunkSize(card, chunk);
+    }
+    // On read error keep the bytes done for the next sync, which can continue from there.
+    done = copyErr == -1 && !fflush(dstStream) ? ftell(dstStream) : 0;
+    // Set the modified time to the date of the picture by the descriptor, before the file gets its name.
+    if (!copyErr && !dateErr) {
+        struct timespec times[2] = {{0, UTIME_OMIT}, {date, 0}};
+        start = monotonicSecs();
+        if (fflush(dstStream) || futimens(fileno(dstStream), times))
+            jp_logf(L_WARN, "\n%s:      WARNING: Cannot set date of file '%s',", MYNAME, partPath);
+        statsPhase(stats, PHASE_SET_DATE, monotonicSecs() - start, 0);
+    }
+    if (fclose(dstStream) && !copyErr) {
+        jp_logf(L_FATAL, "\n%s:       ERROR: File write error on %s.\n", MYNAME, partPath);
+        filesize = -1;
+    }
+    uint64_t contentDigest = xxh64Digest(&digest);
+    int unchanged = 0;
+    if (filesize >= 0 && verify) {
+        statsPhase(stats, PHASE_COMPARE, 0, fetched);
+        if (!(unchanged = contentDigest == backupSum)) {
+            // Find alternative destination file name, which not alredy exists, by inserting a number.
+            alternativeName(dstIndex, dstPath, dstName, file, &altClaim);
+            jp_logf(L_WARN, " different content,\n%s:               so backup '%s' to '%s' ...", MYNAME, file, dstPath);
+        }
+    }
+    if (filesize >= 0 && !unchanged && stats->album) {
+        stats->album->fetched++;
+        stats->album->bytes += fetched;
+    }
+    if (filesize < 0) {
+        if (done > 0 && !partialCheckpoint(partPath, key, size, date, done)) {
+            jp_logf(L_WARN, "%s:       Keeping %ld bytes of '%s' to continue on next sync.\n", MYNAME, done, partPath);
+        } else {
+            partialRemove(partPath); // remove the partially created file
+        }
+    } else if (unchanged) {
+        partialRemove(partPath);
+        jp_logf(L_GUI, " identical\n");
+        manifestUpdate(key, size, date, dstPath + strlen(session->pcPath) + 1, &contentDigest);
+    } else {
+        jp_logf(L_GUI, " OK\n");
+        // The name is taken now, but the file gets it, is recorded and linked to identical content, once
+        // synced to disk together with the other files of its album, so the device waits only for the transfers.
+        if (dstIndex)  dirIndexAdd(dstIndex, dstName);
+        pathCreated(dstPath);
+        deferFileDone(session, key, dstPath, size, date, contentDigest, config->dedupLinks, altClaim.path ? &altClaim : &claim);
+        statErr = 0; // reset old state
+    }
+Exit:
+    releasePath(&altClaim);
+    releasePath(&claim);
+    DLP(session, DLP_FILE_CLOSE, PHASE_OPEN, dlp_VFSFileClose(session->sd, fileRef));
+    if (stats->album && filesize < 0)  stats->album->failed++;
+    trace(TRACE_FILE_DONE, dstPath, filesize, statErr, 0);
+    return filesize;
+}
+
+/*
+ * The file types, the album and file filters are compiled on startup into a nameFilter each. A name is taken,
+ * if it matches any rule of each of RULE_TYPE and RULE_INCLUDE, if there are such rules, and no rule of
+ * RULE_EXCLUDE. Names are matched case insensitive, as on the FAT file system of the Palm. Rules without wildcards
+ * and of the form "*.ext" are hashed, so only the few other globs are matched one by one.
+ */
+static filterRule **filterBucket(const nameFilter *filter, const char *pattern) {
+    return (filterRule **)&filter->buckets[strHash(pattern) & (FILTER_BUCKETS - 1)];
+}
+
+/*
+ * Parse a size limit like "20M" into *size.
+ * Returns the chars parsed, or 0 if there is no number.
+ */
+static int filterSize(const char *str, long *size) {
+    char *end;
+    *size = strtol(str, &end, 10);
+    if (end == str)  return 0;
+    switch (*end) {
+        case 'k': case 'K': *size *= 1024; end++; break;
+        case 'm': case 'M': *size *= 1024 * 1024; end++; break;
+    }
+    return end - str;
+}
+
+/*
+ * Add rule of kind, a glob optionally followed by ">size" and/or "<size", to filter.
+ * Returns 0, also if rule is malformed and so ignored, or -1 if out of memory.
+ */
+int filterAdd(nameFilter *filter, int kind, const char *rule) {
+    size_t len = strcspn(rule, "<>");
+    long minSize = 0, maxSize = -1, size;
+    filterRule *r;
+
+    for (const char *p = rule + len; *p; p += len) {
+        if (!(len = filterSize(p + 1, &size))) {
+            jp_logf(L_WARN, "%s: WARNING: Ignoring filter rule '%s' with bad size\n", MYNAME, rule);
+            return 0;
+        }
+        len++;
+        if (*p == '>')  minSize = size + 1;
+        else  maxSize = size - 1;
+    }
+    len = strcspn(rule, "<>");
+    if (!len)  return 0;
+    if (!(r = mallocLog(sizeof(*r) + len + 1)))  return -1;
+    r->kind = kind;
+    r->minSize = minSize;
+    r->maxSize = maxSize;
+    for (size_t i = 0; i < len; i++)  r->pattern[i] = tolower((unsigned char)rule[i]);
+    r->pattern[len] = 0;
+    const char *wild = strpbrk(r->pattern, "*?[");
+    filterRule **list = !wild || (wild == r->pattern && r->pattern[1] == '.' && !strpbrk(r->pattern + 1, "*?[")) ?
+            filterBucket(filter, r->pattern) : &filter->globs;
+    r->next = *list;
+    *list = r;
+    filter->rules[kind]++;
+    filter->sized |= minSize > 0 || maxSize >= 0;
+    return 0;
+}
+
+/*
+ * Add the rules separated by ';' to filter, each including, or excluding if prefixed by "-".
+ * Returns 0, or -1 if out of memory.
+ */
+int filterCompile(nameFilter *filter, const char *rules) {
+    char copy[strlen(rules) + 1];
+
+    for (char *rule = strtok(strcpy(copy, rules), ";"); rule; rule = strtok(NULL, ";")) {
+        while (isspace((unsigned char)*rule))  rule++;
+        int kind = *rule == '-' ? RULE_EXCLUDE : RULE_INCLUDE;
+        if (filterAdd(filter, kind, rule + (*rule == '-' || *rule == '+')) < 0)  return -1;
+    }
+    return 0;
+}
+
+/*
+ * Match name against filter, and also its size, if known, i.e. >= 0.
+ * Returns FILTER_TAKE, FILTER_SKIP, or FILTER_SIZE if that depends on the size.
+ */
+int filterMatch(const nameFilter *filter, const char *name, long size) {
+    char lower[strlen(name) + 2]; // "*" + name, for the key of "*.ext"
+    int found[RULE_KINDS] = {0}, unsure[RULE_KINDS] = {0}, result = FILTER_TAKE;
+    const char *ext;
+
+    lower[0] = '*';
+    for (size_t i = 0; i <= strlen(name); i++)  lower[i + 1] = tolower((unsigned char)name[i]);
+    ext = strrchr(lower + 1, '.');
+    char extKey[ext ? strlen(ext) + 2 : 1];
+    if (ext)  strcat(strcpy(extKey, "*"), ext);
+    const filterRule *lists[] = {*filterBucket(filter, lower + 1), ext ? *filterBucket(filter, extKey) : NULL, filter->globs};
+    for (int l = 0; l < 3; l++) {
+        for (const filterRule *r = lists[l]; r; r = r->next) {
+            if (l < 2 ? strcmp(r->pattern, l ? extKey : lower + 1) : fnmatch(r->pattern, lower + 1, 0))  continue;
+            if (r->minSize > 0 || r->maxSize >= 0) {
+                if (size < 0) {
+                    unsure[r->kind] = 1;
+                    continue;
+                }
+                if (size < r->minSize || (r->maxSize >= 0 && size > r->maxSize))  continue;
+            }
+            found[r->kind] = 1;
+        }
+    }
+    if (found[RULE_EXCLUDE])  return FILTER_SKIP;
+    if (unsure[RULE_EXCLUDE])  result = FILTER_SIZE;
+    for (int kind = RULE_TYPE; kind <= RULE_INCLUDE; kind++) {
+        if (filter->rules[kind] && !found[kind]) {
+            if (!unsure[kind])  return FILTER_SKIP;
+            result = FILTER_SIZE;
+        }
+    }
+    return result;
+}
+
+void filterFree(nameFilter *filter) {
+    for (int l = 0; l <= FILTER_BUCKETS; l++) {
+        filterRule **list = l < FILTER_BUCKETS ? &filter->buckets[l] : &filter->globs;
+        for (filterRule *r; (r = *list);) {
+            *list = r->next;
+            free(r);
+        }
+    }
+    memset(filter, 0, sizeof(*filter));
+}
+
+/*
+ * Add the root dirs separated by ';' to roots, in their order. The components after the first one with
+ * wildcards are globs to match the dirs below, i.e. "/DCIM/1??*", whose albums are then named by these
+ * components, i.e. "100CANON".
+ * Returns 0, also if a root is malformed and so ignored, or -1 if out of memory.
+ */
+int rootsCompile(rootPattern **roots, const char *rules) {
+    char copy[strlen(rules) + 1];
+
+    while (*roots)  roots = &(*roots)->next;
+    for (char *rule = strtok(strcpy(copy, rules), ";"); rule; rule = strtok(NULL, ";")) {
+        while (isspace((unsigned char)*rule))  rule++;
+        for (char *end = rule + strlen(rule); end > rule + 1 && (isspace((unsigned char)end[-1]) || end[-1] == '/');)  *--end = 0;
+        if (*rule != '/') {
+            if (*rule)  jp_logf(L_WARN, "%s: WARNING: Ignoring root dir '%s' not starting with '/'\n", MYNAME, rule);
+            continue;
+        }
+        // Split at the '/' before the first component with wildcards.
+        char *globs = strpbrk(rule, "*?[");
+        if (globs)  while (*globs != '/')  globs--;
+        else  globs = rule + strlen(rule);
+        size_t len = globs - rule;
+        rootPattern *root;
+        char *part, *save;
+        if (!(root = mallocLog(sizeof(*root) + strlen(rule) + 3)))  return -1;
+        memcpy(root->path, rule, len ? len : 1); // the volume root for i.e. "/Card*"
+        root->path[len ? len : 1] = 0;
+        len = strlen(root->path);
+        root->nameOffset = len + (root->path[len - 1] != '/');
+        root->levels = 0;
+        part = root->path + len + 1;
+        for (size_t i = 0; i <= strlen(globs); i++)  part[i] = tolower((unsigned char)globs[i]);
+        for (part = strtok_r(part, "/", &save); part && root->levels < ROOT_LEVELS; part = strtok_r(NULL, "/", &save))
+            root->parts[root->levels++] = part;
+        if (part) {
+            jp_logf(L_WARN, "%s: WARNING: Ignoring root dir '%s' with more than %d globs\n", MYNAME, rule, ROOT_LEVELS);
+            free(root);
+            continue;
+        }
+        root->next = NULL;
+        *roots = root;
+        roots = &root->next;
+    }
+    return 0;
+}
+
+void rootsFree(rootPattern **roots) {
+    for (rootPattern *root; (root = *roots);) {
+        *roots = root->next;
+        free(root);
+    }
+}
+
+/*
+ * Enumerate all entries of directory dirRef and hand them over to handler in batches of DIR_BATCH_ITEMS,
+ * as they arrive, so there is no upper bound on the number of entries.
+ * The iterator of dlp_VFSDirEntryEnumerate() is not reliable (see: <https://github.com/juddmon/jpilot/issues/41>):
+ * - Sometimes it is vfsIteratorStop after a full batch, even if there are more entries.
+ * - On SDCard it can be out of range, i.e. 1888, after the first batch, so continuing fails.
+ * - It can't be compared with vfsIteratorStop directly (see: <https://github.com/juddmon/jpilot/issues/39>).
+ * So as long as the iterator behaves, each entry is transferred only once. If it becomes suspect, the
+ * enumeration is restarted from vfsIteratorStart with a doubled batch size, and only the entries not yet
+ * delivered are handed over.
+ * Returns the number of entries, or < 0 on error or if handler returned < 0.
+ */
+int dirEnumerate(syncSession *session, FileRef dirRef, const char *dirName, dirEntryHandler handler, void *ctx) {
+    VFSDirInfo *dirInfos = NULL;
+    unsigned long itr = (unsigned long)vfsIteratorStart;
+    int batch = DIR_BATCH_ITEMS, delivered = 0, restart = 0, capacity = 0;
+    PI_ERR result;
+
+    for (;;) {
+        int want = restart ? delivered + batch : batch;
+        if (want > capacity) {
+            VFSDirInfo *grown;
+            if (!(grown = realloc(dirInfos, want * sizeof(*dirInfos)))) {
+                jp_logf(L_FATAL, "%s: ERROR: Out of memory\n", MYNAME);
+                result = -1;
+                break;
+            }
+            dirInfos = grown;
+            capacity = want;
+        }
+        if (restart)  itr = (unsigned long)vfsIteratorStart;
+        int dirItems = want;
+        trace(TRACE_ENUMERATE, dirName, itr, dirItems, 0);
+        if ((result = DLP(session, DLP_DIR_ENTRY_ENUMERATE, PHASE_ENUMERATE, dlp_VFSDirEntryEnumerate(session->sd, dirRef, &itr, &dirItems, dirInfos))) < 0) {
+            if (!restart && delivered) {
+                trace(TRACE_ENUMERATE_RESTART, dirName, itr, 0, 0);
+                restart = 1;
+                continue;
+            }
+            jp_logf(L_FATAL, "%s:     Enumerate ERROR: result=%4d, dirRef=%8lx, itr=%4lx, dirItems=%d\n", MYNAME, result, dirRef, itr, dirItems);
+            break;
+        }
+        trace(TRACE_ENUMERATE_OK, dirName, result, itr, dirItems);
+        int first = restart ? delivered : 0; // entries before were already handed over
+        if (dirItems > first) {
+            if ((result = handler(dirInfos + first, dirItems - first, ctx)) < 0)  break;
+            delivered += dirItems - first;
+        }
+        if (dirItems < want) {
+            result = delivered; // less than requested, so this was the last batch
+            break;
+        }
+        if (restart || (enum dlpVFSFileIteratorConstants)itr == vfsIteratorStop) {
+            // Iterator is suspect, so get more from the start.
+            if (restart)  batch *= 2;
+            restart = 1;
+        }
+    }
+    free(dirInfos);
+    return result;
+}
+
+/*
+ * Queue the subdir name of the dir being walked, if it matches the root pattern, or the album filter below it.
+ * Returns 0, or -1 if out of memory.
+ */
+static int walkAdd(walkContext *walk, const char *name) {
+    const rootPattern *root = walk->root;
+    size_t len = strlen(walk->dir->path);
+    walkDir *sub;
+
+    if (!(sub = mallocLog(sizeof(*sub) + len + strlen(name) + 2)))  return -1;
+    strcpy(sub->path, walk->dir->path);
+    if (sub->path[len - 1] != '/')  sub->path[len++] = '/';
+    strcpy(sub->path + len, name);
+    sub->level = walk->dir->level + 1;
+    sub->next = NULL;
+    if (sub->level <= root->levels) {
+        // Matched case insensitive as the filters.
+        char lower[strlen(name) + 1];
+        for (size_t i = 0; i <= strlen(name); i++)  lower[i] = tolower((unsigned char)name[i]);
+        if (fnmatch(root->parts[sub->level - 1], lower, 0)) {
+            trace(TRACE_DIR_MISMATCH, sub->path, 0, 0, 0);
+            free(sub);
+            return 0;
+        }
+    } else if (filterMatch(&walk->session->config->albumFilter, sub->path + root->nameOffset, -1) == FILTER_SKIP) {
+        // Albums are filtered by their names before opening them, so their subdirs are not walked either.
+        trace(TRACE_ALBUM_FILTERED, sub->path, 0, 0, 0);
+        free(sub);
+        return 0;
+    } else {
+        walk->dirs++;
+    }
+    trace(TRACE_DIR_QUEUED, sub->path, sub->level, 0, 0);
+    *walk->tail = sub;
+    walk->tail = &sub->next;
+    return 0;
+}
+
+static int planDirEntries(const VFSDirInfo *dirInfos, int count, void *ctx) {
+    walkContext *walk = ctx;
+    plannedAlbum *album = walk->album;
+    const syncConfig *config = walk->session->config;
+    syncStats *stats = &walk->session->stats;
+    int walkDeeper = walk->dir->level < walk->root->levels + config->albumDepth;
+
+    for (int i=0; i<count; i++) {
+        const char *fname = dirInfos[i].name;
+        trace(TRACE_FILE_FOUND, fname, dirInfos[i].attr, 0, 0);
+        if (dirInfos[i].attr & vfsFileAttrDirectory) {
+            if (walkDeeper && walkAdd(walk, fname) < 0)  return -1;
+            continue;
+        }
+        // Grab only regular files, but ignore the 'read only' and 'archived' bits,
+        // and only with known extensions.
+        if (!album || dirInfos[i].attr & (
+                vfsFileAttrHidden      |
+                vfsFileAttrSystem      |
+                vfsFileAttrVolumeLabel |
+                vfsFileAttrLink)  ||
+                strlen(fname) < 2 ||
+                filterMatch(&config->fileFilter, fname, -1) == FILTER_SKIP) {
+            continue;
+        }
+        if (stats->album)  stats->album->files++;
+        album->files++;
+        // The size and date on the Palm are only known after opening the file, so without skipKnownFiles it is
+        // opened once by planFile(), which settles it, if unchanged, by the manifest entry and its backup.
+        if (config->skipKnownFiles && !config->compareContent &&
+                (!config->quickCheck || (config->quickCheck == 1 && !fileTypeListed(config->quickCheckTypes, fname))) &&
+                manifestFetched(walk->session, album->card, album->srcAlbumDir, fname)) {
+            trace(TRACE_FILE_KNOWN, fname, 0, 0, 0);
+            continue;
+        }
+        if (planFile(walk->session, walk->plan, album, fname) < 0)  album->result = -1;
+    }
+    return 0;
+}
+
+/*
+ * Tell, whether the files of quickCheckTypes in the album at srcDir are unchanged since print was taken, as
+ * an audio caption can be recorded anew without changing the album. Only these files are opened, by their
+ * names in the manifest, and compared by their dates. Names no longer found on the Palm are left out.
+ */
+static int captionsUnchanged(syncSession *session, int volRef, const char *srcDir, const char *key, const albumPrint *print) {
+    char *names;
+    uint32_t found = 0;
+    uint64_t sum = 0;
+    int result = 1;
+
+    if (!(names = manifestAlbumFiles(key, session->config->quickCheckTypes)))  return 0;
+    for (const char *name = names; result && *name; name += strlen(name) + 1) {
+        char srcPath[strlen(srcDir) + strlen(name) + 2];
+        FileRef fileRef;
+        time_t date;
+        strcat(strcat(strcpy(srcPath, srcDir), "/"), name);
+        if (DLP(session, DLP_FILE_OPEN, PHASE_OPEN, dlp_VFSFileOpen(session->sd, volRef, srcPath, vfsModeRead, &fileRef)) < 0)
+            continue; // deleted
+        if ((result = DLP(session, DLP_FILE_GET_DATE, PHASE_SIZE, dlp_VFSFileGetDate(session->sd, fileRef, vfsFileDateModified, &date)) >= 0)) {
+            sum += captionSum(name, date);
+            result = ++found <= print->rechecks;
+        }
+        DLP(session, DLP_FILE_CLOSE, PHASE_OPEN, dlp_VFSFileClose(session->sd, fileRef));
+    }
+    free(names);
+    return result && found == print->rechecks && sum == print->captions;
+}
+
+/*
+ * Enumerate dir once, queueing its subdirs to walk, and adding its files to plan, which are not known to be
+ * backuped yet, if dir is an album. The dirs matched by the globs of the root pattern are no albums, but only
+ * walked through. An album unchanged since the last sync is not enumerated, unless it has subdirs to walk.
+ * Returns 0, -3 if the root dir does not exist, or < 0 on error.
+ */
+static int planDir(walkContext *walk, const walkDir *dir) {
+    syncSession *session = walk->session;
+    const syncConfig *config = session->config;
+    const rootPattern *root = walk->root;
+    syncStats *stats = &session->stats;
+    const char *name = dir->level ? dir->path + root->nameOffset : NULL; // of the album, NULL for the files in root
+    int unchanged = 0, walkDeeper = dir->level < root->levels + config->albumDepth;
+    plannedAlbum *album = NULL;
+    FileRef dirRef;
+    PI_ERR result = 0;
+
+    if (DLP(session, DLP_FILE_OPEN, PHASE_OPEN, dlp_VFSFileOpen(session->sd, walk->volRef, dir->path, vfsModeRead, &dirRef)) < 0) {
+        if (!dir->level) {
+            jp_logf(L_DEBUG, "%s:   Root '%s' does not exist on volume %d\n", MYNAME, dir->path, walk->volRef);
+            return -3;
+        }
+        jp_logf(L_FATAL, "%s:    ERROR: Could not open dir '%s' on volume %d\n", MYNAME, dir->path, walk->volRef);
+        return -2;
+    }
+    if (!dir->level)  jp_logf(L_DEBUG, "%s:   Opened root '%s' on volume %d\n", MYNAME, dir->path, walk->volRef);
+    walk->dir = dir;
+    walk->dirs = 0;
+    // The root dir forms the unfiled album, filtered only here, as its subdirs are walked anyway.
+    // Apparently the Treo 650 can store pics in the root dir, as well as in album dirs.
+    if (dir->level < root->levels || (dir->level == root->levels &&
+            filterMatch(&config->albumFilter, name ? name : UNFILED_ALBUM, -1) == FILTER_SKIP)) {
+        if (!walkDeeper)  goto Exit;
+    } else {
+        char key[sizeof(session->device) + sizeof(album->card) + strlen(dir->path) + 4];
+        if (!(album = calloc(1, sizeof(*album) + strlen(dir->path) + 1))) {
+            jp_logf(L_FATAL, "%s: ERROR: Out of memory\n", MYNAME);
+            result = -2;
+            goto Exit;
+        }
+        album->volRef = walk->volRef;
+        album->device = session->device;
+        strcpy(album->srcAlbumDir, dir->path);
+        if (!(album->dstAlbumDir = destinationDir(session, walk->volRef, name, album->card))) {
+            jp_logf(L_FATAL, "%s:    ERROR: Could not open dir '%s'\n", MYNAME, album->dstAlbumDir);
+            free(album);
+            result = -2;
+            goto Exit;
+        }
+        jp_logf(L_GUI, "%s:    Searching album '%s' in '%s' on volume %d ...\n", MYNAME, name ? name : ".", root->path, walk->volRef);
+
+        // Skip the album, if it is unchanged since the last sync, and all its files are known by the manifest.
+        albumPrint print;
+        struct stat dstStat;
+        album->fingerprint = config->skipUnchangedAlbums && !config->compareContent && config->quickCheck < 2 &&
+                DLP(session, DLP_FILE_GET_DATE, PHASE_ENUMERATE, dlp_VFSFileGetDate(session->sd, dirRef, vfsFileDateModified, &album->date)) >= 0 &&
+                (album->used = volumeUsed(session, walk->volRef)) >= 0;
+        manifestKey(key, sizeof(key), session->device, album->card, dir->path, "");
+        album->stats = statsAlbumBegin(stats, walk->volRef, album->card, dir->path);
+        if (album->fingerprint && !config->filterChanged && albumPrintGet(key, &print) && print.date == album->date &&
+                print.volumeUsed == album->used && !localStat(session->local, album->dstAlbumDir, &dstStat) && print.dstDate &&
+                print.dstDate == dstStat.st_mtime && print.dstNsec == dstStat.st_mtim.tv_nsec &&
+                (!config->quickCheck || !print.rechecks || captionsUnchanged(session, walk->volRef, dir->path, key, &print))) {
+            trace(TRACE_ALBUM_UNCHANGED, dir->path, 0, 0, 0);
+            if (stats->album)  stats->album->files += print.files;
+            if (!walkDeeper || !print.dirs) {
+                statsAlbumEnd(stats);
+                free(album->dstAlbumDir);
+                free(album);
+                goto Exit;
+            }
+            // Enumerate it only for its subdirs, and fingerprint it again with their number.
+            album->files = print.files;
+            album->rechecks = print.rechecks;
+            album->captions = print.captions;
+            unchanged = 1;
+        } else {
+            album->next = walk->plan->albums;
+            walk->plan->albums = album;
+        }
+    }
+
+    // Iterate over all the entries in the dir, looking for subdirs, jpegs and 3gp's and 3g2's (videos).
+    walk->album = unchanged ? NULL : album;
+    result = dirEnumerate(session, dirRef, dir->path, planDirEntries, walk);
+    walk->album = NULL;
+    if (album) {
+        if (result < 0)  album->result = result;
+        result = album->result;
+        album->dirs = walk->dirs;
+        statsAlbumEnd(stats);
+        if (!album->pending)  albumDone(session, album);
+        if (unchanged)  free(album);
+    }
+Exit:
+    DLP(session, DLP_FILE_CLOSE, PHASE_OPEN, dlp_VFSFileClose(session->sd, dirRef));
+    trace(TRACE_ALBUM_PLANNED, dir->path, result, 0, 0);
+    return MIN(result, 0);
+}
+
+/*
+ *  Plan the backup of all albums from volume volRef.
+ */
+int planVolume(syncSession *session, syncPlan *plan, int volRef) {
+    PI_ERR rootResult = -3, result = 0;
+
+    jp_logf(L_DEBUG, "%s:  Searching roots on volume %d\n", MYNAME, volRef);
+    for (const rootPattern *root = session->config->roots; root; root = root->next) {
+        // Walk the tree breadth first by a queue of the dirs found, but not yet enumerated, so no more than
+        // one enumeration is in progress, however deep the tree is.
+        walkContext walk = {session, plan, volRef, root, NULL, &walk.queue, NULL, NULL, 0};
+        walkDir *dir;
+        if (!(dir = mallocLog(sizeof(*dir) + strlen(root->path) + 1))) {
+            result = -1;
+            break;
+        }
+        strcpy(dir->path, root->path);
+        dir->level = 0;
+        dir->next = NULL;
+        walk.queue = dir;
+        walk.tail = &dir->next;
+        while ((dir = walk.queue)) {
+            if (!(walk.queue = dir->next))  walk.tail = &walk.queue;
+            int dirResult = planDir(&walk, dir);
+            if (!dir->level && dirResult != -3)  rootResult = 0;
+            if (dir->level || dirResult != -3)  result = MIN(result, dirResult);
+            free(dir);
+        }
+    }
+    jp_logf(L_DEBUG, "%s:  Volume %d planned -> rootResult=%d, result=%d\n", MYNAME,  volRef, rootResult, result);
+    return rootResult + result;
+}
+
+/*
+ * Reads the names already existing in the destination album once, instead of probing each file.
+ * Returns 1 if read, -1 if not.
+ */
+static int albumIndex(syncSession *session, plannedAlbum *album) {
+    if (!album->indexed && (album->indexed = dirIndexLoad(&album->dstIndex, album->dstAlbumDir, session->local) < 0 ? -1 : 1) < 0) {
+        jp_logf(L_WARN, "%s:    WARNING: Could not read dir '%s', so checking each file\n", MYNAME, album->dstAlbumDir);
+    }
+    return album->indexed;
+}
+
+/*
+ * Tell, whether file of album, of size and date on the Palm, needs no fetch, as its copy exists with the same
+ * size, and by quickCheck the same date, as fetchFileIfNeeded() would find, and record it in the manifest.
+ * So an unchanged file is settled by the open of planning, and not opened again. Not with compareContent,
+ * which needs the content.
+ */
+static int planUnchanged(syncSession *session, plannedAlbum *album, const char *file, uint32_t size, time_t date) {
+    const syncConfig *config = session->config;
+    char dstPath[strlen(album->dstAlbumDir) + strlen(file) + 14]; // room for a recorded alternative name
+    char *dstName = dstPath + strlen(album->dstAlbumDir) + 1;
+    char key[sizeof(session->device) + sizeof(album->card) + strlen(album->srcAlbumDir) + strlen(file) + 4];
+    struct stat fstat;
+
+    if (config->compareContent || !size)  return 0;
+    manifestKey(key, sizeof(key), session->device, album->card, album->srcAlbumDir, file);
+    strcat(strcat(strcpy(dstPath, album->dstAlbumDir), "/"), file);
+    recordedName(key, session->pcPath, album->dstAlbumDir, dstName, sizeof(dstPath) - (dstName - dstPath));
+    if ((albumIndex(session, album) > 0 && !dirIndexContains(&album->dstIndex, dstName)) ||
+            localStat(session->local, dstPath, &fstat) || !S_ISREG(fstat.st_mode) || fstat.st_size != size ||
+            (config->quickCheck && date && !quickCheckEqual(key, &fstat, date)))  return 0;
+    trace(TRACE_FILE_EXISTS, dstPath, 0, 0, 0);
+    if (!config->dryRun)  manifestUpdate(key, size, date, dstPath + strlen(session->pcPath) + 1, NULL);
+    return 1;
+}
+
+/*
+ * Add file of album to plan with its size and date, so it can be fetched later in the order of syncOrder,
+ * unless it is unchanged.
+ * Returns 0, or -1 on error.
+ */
+int planFile(syncSession *session, syncPlan *plan, plannedAlbum *album, const char *file) {
+    char srcPath[strlen(album->srcAlbumDir) + strlen(file) + 2];
+    plannedFile *planned;
+    FileRef fileRef;
+    int filesize;
+    time_t date;
+
+    strcat(strcat(strcpy(srcPath, album->srcAlbumDir), "/"), file);
+    if (DLP(session, DLP_FILE_OPEN, PHASE_OPEN, dlp_VFSFileOpen(session->sd, album->volRef, srcPath, vfsModeRead, &fileRef)) < 0) {
+          jp_logf(L_FATAL, "%s:      ERROR: Could not open file '%s' on volume %d for reading.\n", MYNAME, srcPath, album->volRef);
+          return -1;
+    }
+    if (DLP(session, DLP_FILE_SIZE, PHASE_SIZE, dlp_VFSFileSize(session->sd, fileRef, &filesize)) < 0) {
+        jp_logf(L_WARN, "%s:      WARNING: Could not get size of '%s' on volume %d, so anyway fetch it.\n", MYNAME, srcPath, album->volRef);
+        filesize = 0;
+    } else if (session->config->fileFilter.sized && filterMatch(&session->config->fileFilter, file, filesize) == FILTER_SKIP) {
+        trace(TRACE_FILE_FILTERED, file, filesize, 0, 0);
+        DLP(session, DLP_FILE_CLOSE, PHASE_OPEN, dlp_VFSFileClose(session->sd, fileRef));
+        return 0;
+    }
+    // Get the date that the picture was created (not the file), aka modified time.
+    if (DLP(session, DLP_FILE_GET_DATE, PHASE_SIZE, dlp_VFSFileGetDate(session->sd, fileRef, vfsFileDateModified, &date)) < 0) {
+        jp_logf(L_WARN, "%s:      WARNING: Cannot get date of file '%s' on volume %d\n", MYNAME, srcPath, album->volRef);
+        date = 0;
+    }
+    DLP(session, DLP_FILE_CLOSE, PHASE_OPEN, dlp_VFSFileClose(session->sd, fileRef));
+    if (fileTypeListed(session->config->quickCheckTypes, file)) {
+        album->rechecks++;
+        album->captions += captionSum(file, date);
+    }
+    if (planUnchanged(session, album, file, filesize, date))  return 0;
+
+    if (plan->count == plan->allocated) {
+        plannedFile **grown;
+        if (!(grown = realloc(plan->files, (plan->allocated ? 2 * plan->allocated : 256) * sizeof(*grown)))) {
+            jp_logf(L_FATAL, "%s: ERROR: Out of memory\n", MYNAME);
+            return -1;
+        }
+        plan->files = grown;
+        plan->allocated = plan->allocated ? 2 * plan->allocated : 256;
+    }
+    if (!(planned = mallocLog(sizeof(*planned) + strlen(file) + 1)))  return -1;
+    planned->album = album;
+    planned->index = plan->count;
+    planned->size = filesize;
+    planned->date = date;
+    switch (session->config->syncOrder) {
+        case ORDER_NEWEST:
+            planned->rank = -(long long)date;
+            break;
+        case ORDER_PHOTOS:
+            planned->rank = fileTypeListed(VIDEO_TYPES, file);
+            break;
+        case ORDER_SMALLEST:
+            planned->rank = filesize;
+            break;
+        default:
+            planned->rank = 0;
+    }
+    strcpy(planned->name, file);
+    plan->files[plan->count++] = planned;
+    plan->bytes += filesize;
+    album->pending++;
+    return 0;
+}
+
+static int plannedFileCompare(const void *a, const void *b) {
+    const plannedFile *f = *(plannedFile * const *)a, *g = *(plannedFile * const *)b;
+    int diff = (f->rank > g->rank) - (f->rank < g->rank);
+    return diff ? diff : (f->index > g->index) - (f->index < g->index);
+}
+
+/*
+ * Sort the planned files by their rank from pref syncOrder, otherwise keeping the order in which they were found.
+ */
+void planSort(syncPlan *plan) {
+    if (plan->count > 1)  qsort(plan->files, plan->count, sizeof(*plan->files), plannedFileCompare);
+}
+
+/*
+ * Called, when all planned files of album are done, to fingerprint it, if all were fetched. The date of its
+ * backup dir is only taken by albumPrintRecord(), when the batches renaming the files into it are done.
+ */
+void albumDone(syncSession *session, plannedAlbum *album) {
+    char key[strlen(album->device) + sizeof(album->card) + strlen(album->srcAlbumDir) + 4];
+    albumPrint *print;
+
+    manifestKey(key, sizeof(key), album->device, album->card, album->srcAlbumDir, "");
+    // Fingerprint the album only, if all its files were fetched, as the backup dir is complete then.
+    if (album->fingerprint && album->result >= 0 &&
+            (print = mallocLog(sizeof(*print) + strlen(key) + strlen(album->dstAlbumDir) + 2))) {
+        *print = (albumPrint){session->donePrints, album->date, 0, 0, album->used, album->files, album->rechecks,
+                album->captions, album->dirs};
+        strcpy(print->key + strlen(strcpy(print->key, key)) + 1, album->dstAlbumDir);
+        session->donePrints = print;
+    } else {
+        albumPrintInvalidate(key);
+    }
+    dirIndexFree(&album->dstIndex);
+    free(album->dstAlbumDir);
+    album->dstAlbumDir = NULL;
+}
+
+/*
+ * Fetch the planned files in their order, logging the progress with the remaining time, estimated from
+ * the throughput so far. When the deadline of plan or syncByteLimit is reached, stop after the current
+ * file. The files left are planned again on the next sync, as they are not in the manifest.
+ * Returns 0, or -1 if any file failed.
+ */
+int planExecute(syncSession *session, syncPlan *plan) {
+    syncStats *stats = &session->stats;
+    long long done = 0;
+    double start = monotonicSecs(), logged = start;
+    int result = 0;
+
+    for (unsigned i = 0; i < plan->count; i++) {
+        plannedFile *file = plan->files[i];
+        plannedAlbum *album = file->album;
+        // At least one file is fetched, so the backlog drains, even if planning took all the time.
+        if (i && ((plan->deadline && monotonicSecs() >= plan->deadline) || (session->config->syncByteLimit > 0 && done >= session->config->syncByteLimit))) {
+            stats->leftFiles = plan->count - i;
+            stats->leftBytes = plan->bytes - done;
+            jp_logf(L_GUI, "%s:    Sync limit reached, leaving %lu files with %llu bytes for the next sync.\n", MYNAME,
+                    stats->leftFiles, stats->leftBytes);
+            break;
+        }
+        albumIndex(session, album);
+        statsAlbumResume(stats, album->stats);
+        if (fetchFileIfNeeded(session, album->volRef, album->card, album->srcAlbumDir, album->dstAlbumDir,
+                album->indexed > 0 ? &album->dstIndex : NULL, file->name, file->size, file->date) < 0) {
+            result = album->result = -1;
+        }
+        statsAlbumEnd(stats);
+        if (!--album->pending) {
+            deferAlbumSync(session, album->dstAlbumDir);
+            albumDone(session, album);
+        }
+        done += file->size;
+        double now = monotonicSecs();
+        if (now - logged >= PROGRESS_SECS && done > 0 && i + 1 < plan->count) {
+            jp_logf(L_GUI, "%s:    %lld of %lld bytes done, about %.0f s left ...\n", MYNAME, done, plan->bytes,
+                    (plan->bytes - done) * (now - start) / done);
+            logged = now;
+        }
+    }
+    deferAlbumSync(session, NULL); // of albums left by the sync limits
+    return result;
+}
+
+/*
+ * Log the planned files instead of fetching them, for pref dryRun.
+ */
+void planReport(const syncPlan *plan) {
+    for (unsigned i = 0; i < plan->count; i++) {
+        const plannedFile *file = plan->files[i];
+        jp_logf(L_GUI, "%s:    Would check '%s/%s' on volume %d, %d bytes\n", MYNAME,
+                file->album->srcAlbumDir, file->name, file->album->volRef, file->size);
+    }
+}
+
+void planFree(syncPlan *plan) {
+    for (plannedAlbum *album; (album = plan->albums);) {
+        plan->albums = album->next;
+        dirIndexFree(&album->dstIndex);
+        free(album->dstAlbumDir);
+        free(album);
+    }
+    for (unsigned i = 0; i < plan->count; i++)  free(plan->files[i]);
+    free(plan->files);
+    memset(plan, 0, sizeof(*plan));
+}
+
+/***********************************************************************
+ *
+ * Function:      volumeEnumerateIncludeHidden
+ *
+ * Summary:       Drop-in replacement for dlp_VFSVolumeEnumerate().
+ *                Attempts to include hidden volumes in the list,
+ *                so that we also get the device's BUILTIN volume.
+ *                Dan Bodoh, May 2, 2008
+ *
+ * Parameters:
+ *  session       --> of the device, which is connected by its socket descriptor
+ *  volume_count  <-> on input, size of volumes; on output
+ *                    number of volumes on Palm
+ *  volumes       <-- volume reference numbers
+ *
+ * Returns:       <-- same as dlp_VFSVolumeEnumerate()
+ *
+ ***********************************************************************/
+int volumeEnumerateIncludeHidden(syncSession *session, int *numVols, int *volRefs) {
+    PI_ERR   result;
+    VFSInfo  volInfo;
+
+    // result on Treo 650:
+    // -301 : No volume (SDCard) found, but maybe hidden volume 1 exists
+    //    4 : At least one volume found, but maybe additional hidden volume 1 exists
+    result = DLP(session, DLP_VOLUME_ENUMERATE, PHASE_ENUMERATE, dlp_VFSVolumeEnumerate(session->sd, numVols, volRefs));
+    jp_logf(L_DEBUG, "%s: dlp_VFSVolumeEnumerate result code %d, found %d volumes\n", MYNAME, result, *numVols);
+    // On the Centro, Treo 650 and maybe more, it appears that the
+    // first non-hidden volRef is 2, and the hidden volRef is 1.
+    // Let's poke around to see, if there is really a volRef 1
+    // that's hidden from the dlp_VFSVolumeEnumerate().
+    if (result < 0)  *numVols = 0; // On Error reset numVols
+    for (int i=0; i<*numVols; i++) { // Search for volume 1
+        jp_logf(L_DEBUG, "%s: *numVols=%d, volRefs[%d]=%d\n", MYNAME, *numVols, i, volRefs[i]);
+        if (volRefs[i]==1)
+            goto Exit; // No need to search for hidden volume
+    }
+    if (volumeInfo(session, 1, &volInfo) >= 0 && volInfo.attributes & vfsVolAttrHidden) {
+        jp_logf(L_DEBUG, "%s: Found hidden volume 1\n", MYNAME);
+        if (*numVols < MAX_VOLUMES)  (*numVols)++;
+        else {
+            jp_logf(L_FATAL, "%s: ERROR: Volumes > %d were discarded\n", MYNAME, MAX_VOLUMES);
+        }
+        for (int i = (*numVols)-1; i > 0; i--) { // Move existing volRefs
+            jp_logf(L_DEBUG, "%s: *numVols=%d, volRefs[%d]=%d, volRefs[%d]=%d\n", MYNAME, *numVols, i-1, volRefs[i-1], i, volRefs[i]);
+            volRefs[i] = volRefs[i-1];
+        }
+        volRefs[0] = 1;
+        if (result < 0)
+            result = 4; // fake dlp_VFSVolumeEnumerate() with 1 volume return value
+    }
+Exit:
+    jp_logf(L_DEBUG, "%s: volumeEnumerateIncludeHidden found %d volumes -> result=%d\n", MYNAME, *numVols, result);
+    return result;
+}
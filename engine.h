@@ -0,0 +1,83 @@
+/*******************************************************************************
+ * engine.h
+ *
+ * Interface of the fetch engine shared by the JPilot plugin and the
+ * picsnvideos-sync tool, see engine.c.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ******************************************************************************/
+
+#ifndef __ENGINE_H__
+#define __ENGINE_H__
+
+#include <stddef.h>
+
+#include "libplugin.h"
+
+#define MYNAME "Pics&Videos"
+#define PCDIR "Media"
+
+#define L_DEBUG JP_LOG_DEBUG
+#define L_INFO  JP_LOG_INFO // Unfortunately doesn't show up in GUI
+#define L_WARN  JP_LOG_WARN
+#define L_FATAL JP_LOG_FATAL
+#define L_GUI   JP_LOG_GUI
+
+typedef struct syncConfig syncConfig;
+typedef struct syncSession syncSession;
+
+/*
+ * Read the prefs from "picsnvideos.rc" in the JPilot data directory.
+ * Returns the config for sessionNew(), or NULL on error.
+ */
+const syncConfig *engineStartup(void);
+/*
+ * Release the config and the manifest, after all sessions are freed.
+ */
+void engineCleanup(void);
+/*
+ * Load the manifest and scan the Media folder by a background thread, while a device connects.
+ * The sessions syncing next use them instead of probing the local files, if starting within 30 seconds after
+ * the scan finished. An older scan is replaced by a new one.
+ */
+void engineWarmUp(void);
+/*
+ * Create a session to sync the device connected by the DLP socket sd.
+ * Returns NULL if out of memory.
+ */
+syncSession *sessionNew(int sd, const syncConfig *config);
+/*
+ * Fetch the media of the device into the Media directory.
+ * Sessions of several devices may sync at once, each by its own thread.
+ * Returns EXIT_SUCCESS, or EXIT_FAILURE if some media could not be fetched.
+ */
+int sessionSync(syncSession *session);
+/*
+ * Finish the local work of sessionSync(), and save the manifest and the statistics.
+ * Call it after the device is released, so the device needs not wait for this.
+ * Returns the result of sessionSync().
+ */
+int sessionFinish(syncSession *session);
+void sessionFree(syncSession *session);
+/*
+ * Write the last events traced by each thread, ordered by time, to file in the JPilot data directory,
+ * or to stderr if file is NULL. sessionFinish() does so after a failed sync.
+ * Returns 0, or -1 on error.
+ */
+int engineTraceDump(const char *file);
+
+void *mallocLog(size_t size);
+
+#endif
@@ -0,0 +1,130 @@
+/*******************************************************************************
+ * jpshim.c
+ *
+ * Minimal replacements of the JPilot functions used by picsnvideos, so the
+ * fetch engine can run outside of JPilot.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ******************************************************************************/
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "libplugin.h"
+
+int glob_log_file_mask = 0;
+int glob_log_stdout_mask = JP_LOG_WARN | JP_LOG_FATAL | JP_LOG_GUI;
+int glob_log_gui_mask = 0;
+
+int jp_logf(int log_level, const char *format, ...) {
+    va_list args;
+    if (!(log_level & glob_log_stdout_mask))  return 0;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    return 0;
+}
+
+void jp_init(void) {
+}
+
+/*
+ * As in JPilot: "$JPILOT_HOME/.jpilot/file", or "$HOME/.jpilot/file".
+ */
+int jp_get_home_file_name(const char *file, char *full_name, int max_size) {
+    const char *home;
+    if (!(home = getenv("JPILOT_HOME")) && !(home = getenv("HOME")))  return -1;
+    if (snprintf(full_name, max_size, "%s/.jpilot/%s", home, file) >= max_size)  return -1;
+    return EXIT_SUCCESS;
+}
+
+FILE *jp_open_home_file(char *filename, char *mode) {
+    char path[1024];
+    if (jp_get_home_file_name(filename, path, sizeof(path)) < 0)  return NULL;
+    return fopen(path, mode);
+}
+
+void jp_pref_init(prefType prefs[], int count) {
+    for (int i = 0; i < count; i++) {
+        if (prefs[i].usertype == CHARTYPE) {
+            const char *init = prefs[i].svalue ? prefs[i].svalue : "";
+            int size = prefs[i].svalue_size > (int)strlen(init) ? prefs[i].svalue_size : (int)strlen(init) + 1;
+            if ((prefs[i].svalue = malloc(size)))  strcpy(prefs[i].svalue, init);
+            prefs[i].svalue_size = size;
+        }
+    }
+}
+
+void jp_free_prefs(prefType prefs[], int count) {
+    for (int i = 0; i < count; i++) {
+        if (prefs[i].usertype == CHARTYPE) {
+            free(prefs[i].svalue);
+            prefs[i].svalue = NULL;
+        }
+    }
+}
+
+int jp_get_pref(prefType prefs[], int which, long *n, const char **string) {
+    if (which < 0)  return -1;
+    if (n)  *n = prefs[which].ivalue;
+    if (string)  *string = prefs[which].usertype == CHARTYPE ? prefs[which].svalue : NULL;
+    return 0;
+}
+
+int jp_set_pref(prefType prefs[], int which, long n, const char *string) {
+    if (which < 0)  return -1;
+    prefs[which].ivalue = n;
+    if (string && prefs[which].usertype == CHARTYPE) {
+        if ((int)strlen(string) >= prefs[which].svalue_size) {
+            char *svalue;
+            if (!(svalue = realloc(prefs[which].svalue, strlen(string) + 1)))  return -1;
+            prefs[which].svalue = svalue;
+            prefs[which].svalue_size = strlen(string) + 1;
+        }
+        strcpy(prefs[which].svalue, string);
+    }
+    return 0;
+}
+
+int jp_pref_read_rc_file(const char *filename, prefType prefs[], int num_prefs) {
+    char line[1024];
+    FILE *in;
+    if (!(in = jp_open_home_file((char *)filename, "r")))  return -1;
+    while (fgets(line, sizeof(line), in)) {
+        char *value;
+        line[strcspn(line, "\r\n")] = 0;
+        if (!(value = strchr(line, ' ')))  continue;
+        *value++ = 0;
+        for (int i = 0; i < num_prefs; i++) {
+            if (strcmp(prefs[i].name, line))  continue;
+            if (prefs[i].filetype == INTTYPE)  jp_set_pref(prefs, i, atol(value), NULL);
+            else  jp_set_pref(prefs, i, 0, value);
+        }
+    }
+    fclose(in);
+    return 0;
+}
+
+int jp_pref_write_rc_file(const char *filename, prefType prefs[], int num_prefs) {
+    FILE *out;
+    if (!(out = jp_open_home_file((char *)filename, "w")))  return -1;
+    for (int i = 0; i < num_prefs; i++) {
+        if (prefs[i].filetype == INTTYPE)  fprintf(out, "%s %ld\n", prefs[i].name, prefs[i].ivalue);
+        else  fprintf(out, "%s %s\n", prefs[i].name, prefs[i].svalue ? prefs[i].svalue : "");
+    }
+    return fclose(out) ? -1 : 0;
+}
@@ -0,0 +1,184 @@
+/*******************************************************************************
+ * picsnvideos-sync.c
+ *
+ * Fetches the media of Palm devices without JPilot, by the same engine and
+ * prefs as the plugin, e.g. for bulk ingest of many devices.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ******************************************************************************/
+
+#include "config.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#ifdef MOCK_DLP
+#include "bench/mockdlp.h"
+#else
+#include <pi-dlp.h>
+#include <pi-socket.h>
+#endif
+
+#include "libplugin.h"
+#include "engine.h"
+
+#ifdef MOCK_DLP
+#define PORTS "root"
+#define PORT_HELP "  root          directory with the volumes of a simulated device, see bench/mockdlp.c\n"
+#else
+#define PORTS "port"
+#define PORT_HELP "  port          pilot-link port of a device, e.g. usb: or /dev/ttyUSB0\n"
+#endif
+
+static const char USAGE[] =
+"Usage: picsnvideos-sync [options] "PORTS" ...\n\
+Fetches the media of the devices on each "PORTS" at once into the folder\n\
+'"PCDIR"' of \"$JPILOT_HOME/.jpilot\", by the prefs of picsnvideos.rc.\n\
+"PORT_HELP"\
+  -n count      syncs per "PORTS", 0: until killed, default: 1\n\
+  -v            show debug output, and the trace of the last events at the end\n\
+  -q            show only warnings and errors\n";
+
+typedef struct {
+    const char *port;
+    int sd;    // the device of the mock
+    int count; // syncs to do, 0 = unlimited
+    const syncConfig *config;
+    int failed;
+} portWorker;
+
+/*
+ * Wait for the next device on the port of worker, and warm up the engine during its handshake.
+ * Returns its socket descriptor, or a negative value on error.
+ */
+static int deviceConnect(portWorker *worker) {
+#ifdef MOCK_DLP
+    engineWarmUp();
+    return worker->sd;
+#else
+    int listener, sd;
+
+    if ((listener = pi_socket(PI_AF_PILOT, PI_SOCK_STREAM, PI_PF_DLP)) < 0) {
+        jp_logf(L_FATAL, "%s: ERROR: Could not create socket for '%s'\n", MYNAME, worker->port);
+        return -1;
+    }
+    if (pi_bind(listener, worker->port) < 0 || pi_listen(listener, 1) < 0) {
+        jp_logf(L_FATAL, "%s: ERROR: Could not listen on '%s'\n", MYNAME, worker->port);
+        pi_close(listener);
+        return -1;
+    }
+    jp_logf(L_GUI, "%s: Waiting for a device on '%s' ...\n", MYNAME, worker->port);
+    // pilot-link hands over the listening socket for serial and USB ports, so only close it otherwise.
+    if ((sd = pi_accept(listener, NULL, NULL)) < 0)
+        jp_logf(L_FATAL, "%s: ERROR: Could not accept a device on '%s'\n", MYNAME, worker->port);
+    if (sd != listener)  pi_close(listener);
+    // Only now, as the wait may be long, and the scan must not miss copies deleted meanwhile.
+    if (sd >= 0)  engineWarmUp(); // while the device handshakes
+    if (sd >= 0 && dlp_OpenConduit(sd) < 0) {
+        jp_logf(L_FATAL, "%s: ERROR: Could not open the conduit on '%s'\n", MYNAME, worker->port);
+        pi_close(sd);
+        return -1;
+    }
+    return sd;
+#endif
+}
+
+static void deviceDisconnect(int sd) {
+#ifndef MOCK_DLP
+    dlp_EndOfSync(sd, dlpEndCodeNormal);
+    pi_close(sd);
+#endif
+}
+
+/*
+ * Sync the devices coming one after another on the port of worker.
+ */
+static void *portSync(void *arg) {
+    portWorker *worker = arg;
+
+    for (int n = 0; !worker->count || n < worker->count; n++) {
+        syncSession *session;
+        int sd;
+
+        if ((sd = deviceConnect(worker)) < 0) {
+            worker->failed = 1;
+            break;
+        }
+        if (!(session = sessionNew(sd, worker->config)) || sessionSync(session) != EXIT_SUCCESS)
+            worker->failed = 1;
+        deviceDisconnect(sd);
+        if (session && sessionFinish(session) != EXIT_SUCCESS)
+            worker->failed = 1;
+        sessionFree(session);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    const syncConfig *config;
+    int count = 1, verbose = 0, opt, result = EXIT_SUCCESS;
+
+    glob_log_stdout_mask = JP_LOG_INFO | JP_LOG_WARN | JP_LOG_FATAL | JP_LOG_GUI;
+    while ((opt = getopt(argc, argv, "n:vqh")) != -1) {
+        switch (opt) {
+            case 'n': count = atoi(optarg) > 0 ? atoi(optarg) : 0; break;
+            case 'v': glob_log_stdout_mask = 0xffff; verbose = 1; break;
+            case 'q': glob_log_stdout_mask = JP_LOG_WARN | JP_LOG_FATAL; break;
+            default:
+                fputs(USAGE, stderr);
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    int ports = argc - optind;
+    if (ports < 1) {
+        fputs(USAGE, stderr);
+        return EXIT_FAILURE;
+    }
+
+    portWorker workers[ports];
+    pthread_t threads[ports];
+    for (int i = 0; i < ports; i++) {
+        workers[i] = (portWorker){argv[optind + i], i, count, NULL, 0};
+#ifdef MOCK_DLP
+        static const mockConfig mock = {0, 0, 0, 0};
+        if ((i ? mockAddDevice(workers[i].port) : mockInit(workers[i].port, &mock)) != i) {
+            fprintf(stderr, "Too many devices for the mock\n");
+            return EXIT_FAILURE;
+        }
+#endif
+    }
+
+    jp_init();
+    if (!(config = engineStartup()))  return EXIT_FAILURE;
+    int started = 0;
+    for (; started < ports; started++) {
+        workers[started].config = config;
+        if (pthread_create(&threads[started], NULL, portSync, &workers[started])) {
+            jp_logf(L_FATAL, "%s: ERROR: Could not start a thread for '%s'\n", MYNAME, workers[started].port);
+            result = EXIT_FAILURE;
+            break;
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        if (workers[i].failed)  result = EXIT_FAILURE;
+    }
+    if (verbose)  engineTraceDump(NULL);
+    engineCleanup();
+    return result;
+}